@@ -0,0 +1,248 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "downscale.h"
+
+#include <string.h>
+
+/* output pixels shrunk per pass, bounds the block sums kept on the stack */
+#define DOWNSCALE_CHUNK 64
+
+static void sum_row_scalar(uint16_t *sums, const uint8_t *row,
+    size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    sums[i] += row[i];
+  }
+}
+
+static void average_row_scalar(const uint16_t *sums, uint8_t *out,
+    size_t count, unsigned shift, bool swap_rb) {
+  size_t values = ((size_t) 1 << shift) * 4;
+  unsigned bits = shift * 2;
+  for (size_t x = 0; x < count; x++, sums += values) {
+    unsigned round = 1u << (bits - 1);
+    unsigned total[4] = { round, round, round, round };
+    for (size_t i = 0; i < values; i++) {
+      total[i & 3] += sums[i];
+    }
+    for (int c = 0; c < 4; c++) {
+      int sc = swap_rb && c != 3 ? 2 - c : c;
+      *out++ = total[sc] >> bits;
+    }
+  }
+}
+
+static const struct wd_downscale_kernel kernel_scalar = {
+  "scalar", sum_row_scalar, average_row_scalar
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static void sum_row_sse2(uint16_t *sums, const uint8_t *row, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) (row + i));
+    __m128i *lo = (__m128i *) (sums + i);
+    __m128i *hi = (__m128i *) (sums + i + 8);
+    _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo),
+          _mm_unpacklo_epi8(pixels, zero)));
+    _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi),
+          _mm_unpackhi_epi8(pixels, zero)));
+  }
+  sum_row_scalar(sums + i, row + i, count - i);
+}
+
+/* sums of a block, two pixels per vector, for blocks of 2 to 16 pixels */
+static inline __m128i block_sums_sse2(const uint16_t *sums, size_t vectors) {
+  __m128i acc = _mm_loadu_si128((const __m128i *) sums);
+  for (size_t i = 1; i < vectors; i++) {
+    acc = _mm_add_epi16(acc, _mm_loadu_si128((const __m128i *) sums + i));
+  }
+  return acc;
+}
+
+/*
+ * Folds the two-pixel sums of two blocks into two averaged output pixels.
+ * The totals stay below 256 * 255 + 128, so 16 bits are enough.
+ */
+static inline void store_pair_sse2(uint8_t *out, __m128i a, __m128i b,
+    __m128i round, __m128i bits, bool swap_rb) {
+  a = _mm_add_epi16(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+  b = _mm_add_epi16(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2)));
+  __m128i avg = _mm_srl_epi16(
+      _mm_add_epi16(_mm_unpacklo_epi64(a, b), round), bits);
+  if (swap_rb) {
+    avg = _mm_shufflelo_epi16(avg, _MM_SHUFFLE(3, 0, 1, 2));
+    avg = _mm_shufflehi_epi16(avg, _MM_SHUFFLE(3, 0, 1, 2));
+  }
+  _mm_storel_epi64((__m128i *) out, _mm_packus_epi16(avg, avg));
+}
+
+static void average_row_sse2(const uint16_t *sums, uint8_t *out,
+    size_t count, unsigned shift, bool swap_rb) {
+  size_t values = ((size_t) 1 << shift) * 4;
+  size_t vectors = values / 8;
+  const __m128i round = _mm_set1_epi16(1 << (shift * 2 - 1));
+  const __m128i bits = _mm_cvtsi32_si128(shift * 2);
+  size_t x = 0;
+  for (; x + 2 <= count; x += 2, sums += values * 2, out += 8) {
+    store_pair_sse2(out, block_sums_sse2(sums, vectors),
+        block_sums_sse2(sums + values, vectors), round, bits, swap_rb);
+  }
+  average_row_scalar(sums, out, count - x, shift, swap_rb);
+}
+
+static const struct wd_downscale_kernel kernel_sse2 = {
+  "sse2", sum_row_sse2, average_row_sse2
+};
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define HAVE_AVX2_KERNEL
+
+__attribute__((target("avx2")))
+static void sum_row_avx2(uint16_t *sums, const uint8_t *row, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i pixels = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128((const __m128i *) (row + i)));
+    __m256i *acc = (__m256i *) (sums + i);
+    _mm256_storeu_si256(acc, _mm256_add_epi16(_mm256_loadu_si256(acc),
+          pixels));
+  }
+  sum_row_scalar(sums + i, row + i, count - i);
+}
+
+/* like block_sums_sse2, four pixels at a time for blocks of 4 or more */
+__attribute__((target("avx2")))
+static inline __m128i block_sums_avx2(const uint16_t *sums, size_t values) {
+  if (values < 16) {
+    return _mm_loadu_si128((const __m128i *) sums);
+  }
+  __m256i acc = _mm256_loadu_si256((const __m256i *) sums);
+  for (size_t i = 16; i < values; i += 16) {
+    acc = _mm256_add_epi16(acc,
+        _mm256_loadu_si256((const __m256i *) (sums + i)));
+  }
+  return _mm_add_epi16(_mm256_castsi256_si128(acc),
+      _mm256_extracti128_si256(acc, 1));
+}
+
+__attribute__((target("avx2")))
+static void average_row_avx2(const uint16_t *sums, uint8_t *out,
+    size_t count, unsigned shift, bool swap_rb) {
+  size_t values = ((size_t) 1 << shift) * 4;
+  const __m128i round = _mm_set1_epi16(1 << (shift * 2 - 1));
+  const __m128i bits = _mm_cvtsi32_si128(shift * 2);
+  size_t x = 0;
+  for (; x + 2 <= count; x += 2, sums += values * 2, out += 8) {
+    store_pair_sse2(out, block_sums_avx2(sums, values),
+        block_sums_avx2(sums + values, values), round, bits, swap_rb);
+  }
+  average_row_scalar(sums, out, count - x, shift, swap_rb);
+}
+
+static const struct wd_downscale_kernel kernel_avx2 = {
+  "avx2", sum_row_avx2, average_row_avx2
+};
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static void sum_row_neon(uint16_t *sums, const uint8_t *row, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16_t pixels = vld1q_u8(row + i);
+    vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(pixels)));
+    vst1q_u16(sums + i + 8,
+        vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(pixels)));
+  }
+  sum_row_scalar(sums + i, row + i, count - i);
+}
+
+/* the four channel sums of one block */
+static inline uint16x4_t block_sums_neon(const uint16_t *sums,
+    size_t values) {
+  uint16x8_t acc = vld1q_u16(sums);
+  for (size_t i = 8; i < values; i += 8) {
+    acc = vaddq_u16(acc, vld1q_u16(sums + i));
+  }
+  return vadd_u16(vget_low_u16(acc), vget_high_u16(acc));
+}
+
+static void average_row_neon(const uint16_t *sums, uint8_t *out,
+    size_t count, unsigned shift, bool swap_rb) {
+  static const uint8_t swap_idx[8] = { 2, 1, 0, 3, 6, 5, 4, 7 };
+  const uint8x8_t swap = vld1_u8(swap_idx);
+  const int16x8_t bits = vdupq_n_s16(-(int16_t) (shift * 2));
+  size_t values = ((size_t) 1 << shift) * 4;
+  size_t x = 0;
+  for (; x + 2 <= count; x += 2, sums += values * 2, out += 8) {
+    uint16x8_t total = vcombine_u16(block_sums_neon(sums, values),
+        block_sums_neon(sums + values, values));
+    /* rounding shift right, done without overflowing 16 bits */
+    uint8x8_t pixels = vmovn_u16(vrshlq_u16(total, bits));
+    if (swap_rb) {
+      pixels = vtbl1_u8(pixels, swap);
+    }
+    vst1_u8(out, pixels);
+  }
+  average_row_scalar(sums, out, count - x, shift, swap_rb);
+}
+
+static const struct wd_downscale_kernel kernel_neon = {
+  "neon", sum_row_neon, average_row_neon
+};
+#endif
+
+static const struct wd_downscale_kernel *kernels[4];
+static size_t kernel_count;
+
+const struct wd_downscale_kernel *const *wd_downscale_kernels(size_t *count) {
+  if (kernel_count == 0) {
+    kernels[kernel_count++] = &kernel_scalar;
+#if defined(__SSE2__)
+    kernels[kernel_count++] = &kernel_sse2;
+#endif
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      kernels[kernel_count++] = &kernel_avx2;
+    }
+#endif
+#if defined(__ARM_NEON)
+    kernels[kernel_count++] = &kernel_neon;
+#endif
+  }
+  *count = kernel_count;
+  return kernels;
+}
+
+void wd_downscale_region(const struct wd_downscale_kernel *kernel,
+    const uint8_t *src, unsigned src_stride,
+    uint8_t *dst, unsigned dst_stride,
+    int x, int y, int width, int height, unsigned shift, bool swap_rb) {
+  uint16_t sums[(DOWNSCALE_CHUNK << WD_DOWNSCALE_MAX_SHIFT) * 4];
+  size_t block = (size_t) 1 << shift;
+  for (int row_y = y; row_y < y + height; row_y++) {
+    const uint8_t *rows = src + ((size_t) row_y << shift) * src_stride;
+    uint8_t *out = dst + (size_t) row_y * dst_stride + (size_t) x * 4;
+    for (int left = 0; left < width; left += DOWNSCALE_CHUNK) {
+      size_t count = width - left < DOWNSCALE_CHUNK
+        ? (size_t) (width - left) : DOWNSCALE_CHUNK;
+      size_t values = (count << shift) * 4;
+      const uint8_t *row = rows + ((size_t) (x + left) << shift) * 4;
+      memset(sums, 0, values * sizeof(*sums));
+      for (size_t i = 0; i < block; i++, row += src_stride) {
+        kernel->sum_row(sums, row, values);
+      }
+      kernel->average_row(sums, out, count, shift, swap_rb);
+      out += count * 4;
+    }
+  }
+}
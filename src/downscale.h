@@ -0,0 +1,51 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#ifndef WDISPLAY_DOWNSCALE_H
+#define WDISPLAY_DOWNSCALE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* largest reduction is 2^WD_DOWNSCALE_MAX_SHIFT */
+#define WD_DOWNSCALE_MAX_SHIFT 4
+
+/*
+ * One implementation of the box filter behind wd_downscale. All of them give
+ * the same result.
+ */
+struct wd_downscale_kernel {
+  const char *name;
+  /*
+   * Adds count bytes of a source row to 16-bit running sums. A block holds
+   * at most 2^(2 * WD_DOWNSCALE_MAX_SHIFT) = 256 values of each channel, so
+   * the sums cannot overflow.
+   */
+  void (*sum_row)(uint16_t *sums, const uint8_t *row, size_t count);
+  /*
+   * Turns the column sums of count blocks, each 2^shift pixels wide, into
+   * count output pixels holding the rounded average of each block. With
+   * swap_rb set, the red and blue channels trade places on the way.
+   */
+  void (*average_row)(const uint16_t *sums, uint8_t *out, size_t count,
+      unsigned shift, bool swap_rb);
+};
+
+/*
+ * Returns the kernels this CPU can run, the portable one first and the
+ * fastest one last.
+ */
+const struct wd_downscale_kernel *const *wd_downscale_kernels(size_t *count);
+
+/*
+ * Shrinks a 32-bit image by 2^shift (1 <= shift <= WD_DOWNSCALE_MAX_SHIFT)
+ * with the given kernel, writing only the width by height destination pixels
+ * at x, y.
+ */
+void wd_downscale_region(const struct wd_downscale_kernel *kernel,
+    const uint8_t *src, unsigned src_stride,
+    uint8_t *dst, unsigned dst_stride,
+    int x, int y, int width, int height, unsigned shift, bool swap_rb);
+
+#endif
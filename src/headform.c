@@ -20,6 +20,12 @@ typedef struct _WdHeadFormPrivate {
 
   GAction *mode_action;
   GAction *rotate_action;
+
+  /* the mode menu is only rebuilt when the modes or their failures change */
+  GMenuModel *mode_menu;
+  const struct wd_head *mode_menu_head;
+  unsigned mode_menu_generation;
+  unsigned mode_menu_failures;
 } WdHeadFormPrivate;
 
 enum {
@@ -107,8 +113,15 @@ static void flipped_toggled(GtkToggleButton *toggle, gpointer data) {
   g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_TRANSFORM);
 }
 
+static void wd_head_form_dispose(GObject *object) {
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(WD_HEAD_FORM(object));
+  g_clear_object(&priv->mode_menu);
+  G_OBJECT_CLASS(wd_head_form_parent_class)->dispose(object);
+}
+
 static void wd_head_form_class_init(WdHeadFormClass *class) {
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(class);
+  G_OBJECT_CLASS(class)->dispose = wd_head_form_dispose;
 
   signals[CHANGED] = g_signal_new("changed",
       G_OBJECT_CLASS_TYPE(class),
@@ -219,6 +232,37 @@ static void wd_head_form_init(WdHeadForm *form) {
   g_object_unref(head_actions);
 }
 
+void wd_head_form_update_modes(WdHeadForm *form, const struct wd_head *head) {
+  g_return_if_fail(form);
+  g_return_if_fail(head);
+
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
+  if (priv->mode_menu != NULL && priv->mode_menu_head == head
+      && priv->mode_menu_generation == head->modes_generation
+      && priv->mode_menu_failures == head->failed_modes_generation)
+    return;
+
+  GMenu *mode_menu = g_menu_new();
+  struct wd_mode **indexed;
+  g_autofree gchar *action = g_strdup_printf("%s.%s", HEAD_PREFIX, MODE_PREFIX);
+  wl_array_for_each(indexed, &head->sorted_modes) {
+    const struct wd_mode *mode = *indexed;
+    g_autofree gchar *name = g_strdup_printf("%d×%d@%0.3fHz%s", mode->width, mode->height, mode->refresh / 1000.,
+        wd_test_mode_result(mode) == WD_TEST_FAILED ? " (unsupported)" : "");
+    GMenuItem *item = g_menu_item_new(name, action);
+    g_menu_item_set_attribute_value(item, G_MENU_ATTRIBUTE_TARGET,
+        create_mode_variant(mode->width, mode->height, mode->refresh));
+    g_menu_append_item(mode_menu, item);
+    g_object_unref(item);
+  }
+  gtk_menu_button_set_menu_model(GTK_MENU_BUTTON(priv->mode_button), G_MENU_MODEL(mode_menu));
+  g_clear_object(&priv->mode_menu);
+  priv->mode_menu = G_MENU_MODEL(mode_menu);
+  priv->mode_menu_head = head;
+  priv->mode_menu_generation = head->modes_generation;
+  priv->mode_menu_failures = head->failed_modes_generation;
+}
+
 void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
     enum wd_head_fields fields) {
   g_return_if_fail(form);
@@ -244,17 +288,7 @@ void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
   }
 
   if (fields & WD_FIELD_MODE) {
-    GMenu *mode_menu = g_menu_new();
-    struct wd_mode *mode;
-    g_autofree gchar *action = g_strdup_printf("%s.%s", HEAD_PREFIX, MODE_PREFIX);
-    wl_list_for_each(mode, &head->modes, link) {
-      g_autofree gchar *name = g_strdup_printf("%d×%d@%0.3fHz", mode->width, mode->height, mode->refresh / 1000.);
-      GMenuItem *item = g_menu_item_new(name, action);
-      g_menu_item_set_attribute_value(item, G_MENU_ATTRIBUTE_TARGET,
-          create_mode_variant(mode->width, mode->height, mode->refresh));
-      g_menu_append_item(mode_menu, item);
-    }
-    gtk_menu_button_set_menu_model(GTK_MENU_BUTTON(priv->mode_button), G_MENU_MODEL(mode_menu));
+    wd_head_form_update_modes(form, head);
     // Mode entries
     int w = head->custom_mode.width;
     int h = head->custom_mode.height;
@@ -263,16 +297,10 @@ void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
       w = head->mode->width;
       h = head->mode->height;
       r = head->mode->refresh;
-    } else if (!head->enabled && w == 0 && h == 0) {
-      struct wd_mode *mode;
-      wl_list_for_each(mode, &head->modes, link) {
-        if (mode->preferred) {
-          w = mode->width;
-          h = mode->height;
-          r = mode->refresh;
-          break;
-        }
-      }
+    } else if (!head->enabled && w == 0 && h == 0 && head->preferred_mode != NULL) {
+      w = head->preferred_mode->width;
+      h = head->preferred_mode->height;
+      r = head->preferred_mode->refresh;
     }
 
     g_action_change_state(priv->mode_action, create_mode_variant(w, h, r));
@@ -293,7 +321,7 @@ void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
   if (fields & WD_FIELD_ENABLED) {
     head_form_update_sensitivity(form);
   }
-  g_signal_emit(form, signals[CHANGED], 0);
+  g_signal_emit(form, signals[CHANGED], 0, fields);
 }
 
 GtkWidget *wd_head_form_new(void) {
@@ -305,47 +333,38 @@ gboolean wd_head_form_get_enabled(WdHeadForm *form) {
   return gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->enabled));
 }
 
-gboolean wd_head_form_has_changes(WdHeadForm *form, const struct wd_head *head) {
-  g_return_val_if_fail(form, FALSE);
+enum wd_head_fields wd_head_layout_get_changes(
+    const struct wd_head_layout *layout, const struct wd_head *head) {
+  g_return_val_if_fail(layout, 0);
 
-  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
-  if (head->enabled != gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->enabled))) {
-    return TRUE;
+  enum wd_head_fields fields = 0;
+  if (head->enabled != layout->enabled) {
+    fields |= WD_FIELD_ENABLED;
   }
   double old_scale = round(head->scale * 100.) / 100.;
-  double new_scale = round(gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->scale)) * 100.) / 100.;
+  double new_scale = round(layout->scale * 100.) / 100.;
   if (old_scale != new_scale) {
-    return TRUE;
-  }
-  if (head->x != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_x))) {
-    return TRUE;
+    fields |= WD_FIELD_SCALE;
   }
-  if (head->y != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_y))) {
-    return TRUE;
+  if (head->x != layout->x || head->y != layout->y) {
+    fields |= WD_FIELD_POSITION;
   }
   int w = head->mode != NULL ? head->mode->width : head->custom_mode.width;
-  if (w != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->width))) {
-    return TRUE;
-  }
   int h = head->mode != NULL ? head->mode->height : head->custom_mode.height;
-  if (h != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->height))) {
-    return TRUE;
-  }
   int r = head->mode != NULL ? head->mode->refresh : head->custom_mode.refresh;
-  if (r / 1000. != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->refresh))) {
-    return TRUE;
-  }
-  if (g_variant_get_int32(g_action_get_state(priv->rotate_action)) != get_rotate_value(head->transform)) {
-    return TRUE;
+  if (w != layout->width || h != layout->height
+      || r / 1000. != layout->refresh) {
+    fields |= WD_FIELD_MODE;
   }
   bool flipped = head->transform == WL_OUTPUT_TRANSFORM_FLIPPED
     || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
     || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_180
     || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
-  if (flipped != gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped))) {
-    return TRUE;
+  if (layout->rotation_id * 90 != get_rotate_value(head->transform)
+      || flipped != layout->flipped) {
+    fields |= WD_FIELD_TRANSFORM;
   }
-  return FALSE;
+  return fields;
 }
 
 void wd_head_form_fill_config(WdHeadForm *form, struct wd_head_config *output) {
@@ -370,24 +389,67 @@ void wd_head_form_fill_config(WdHeadForm *form, struct wd_head_config *output) {
   }
 }
 
-void wd_head_form_get_dimensions(WdHeadForm *form, WdHeadDimensions *dimensions) {
+void wd_head_form_get_layout(WdHeadForm *form, struct wd_head_layout *layout) {
   g_return_if_fail(form);
-  g_return_if_fail(dimensions);
+  g_return_if_fail(layout);
 
   WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
 
-  dimensions->x = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_x));
-  dimensions->y = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_y));
-  dimensions->w = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->width));
-  dimensions->h = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->height));
-  dimensions->scale = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->scale));
-  dimensions->rotation_id = g_variant_get_int32(g_action_get_state(priv->rotate_action)) / 90;
-  dimensions->flipped = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped));
+  layout->enabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->enabled));
+  layout->x = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_x));
+  layout->y = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_y));
+  layout->width = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->width));
+  layout->height = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->height));
+  layout->refresh = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->refresh));
+  layout->scale = gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->scale));
+  layout->rotation_id = g_variant_get_int32(g_action_get_state(priv->rotate_action)) / 90;
+  layout->flipped = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped));
+}
+
+void wd_head_form_set_invalid(WdHeadForm *form, enum wd_head_fields fields) {
+  g_return_if_fail(form);
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
+  const struct {
+    GtkWidget *widget;
+    enum wd_head_fields field;
+  } widgets[] = {
+    { priv->enabled, WD_FIELD_ENABLED },
+    { priv->mode_button, WD_FIELD_MODE },
+    { priv->width, WD_FIELD_MODE },
+    { priv->height, WD_FIELD_MODE },
+    { priv->refresh, WD_FIELD_MODE },
+    { priv->scale, WD_FIELD_SCALE },
+    { priv->pos_x, WD_FIELD_POSITION },
+    { priv->pos_y, WD_FIELD_POSITION },
+    { priv->rotate_button, WD_FIELD_TRANSFORM },
+    { priv->flipped, WD_FIELD_TRANSFORM },
+  };
+  for (size_t i = 0; i < G_N_ELEMENTS(widgets); i++) {
+    GtkStyleContext *context = gtk_widget_get_style_context(widgets[i].widget);
+    if (fields & widgets[i].field)
+      gtk_style_context_add_class(context, GTK_STYLE_CLASS_ERROR);
+    else
+      gtk_style_context_remove_class(context, GTK_STYLE_CLASS_ERROR);
+  }
 }
 
 void wd_head_form_set_position(WdHeadForm *form, double x, double y) {
   g_return_if_fail(form);
   WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
-  gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_x), x);
-  gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_y), y);
+  GtkSpinButton *pos_x = GTK_SPIN_BUTTON(priv->pos_x);
+  GtkSpinButton *pos_y = GTK_SPIN_BUTTON(priv->pos_y);
+  double old_x = gtk_spin_button_get_value(pos_x);
+  double old_y = gtk_spin_button_get_value(pos_y);
+
+  // report both coordinates as one change
+  g_signal_handlers_block_by_func(pos_x, position_spin_changed, form);
+  g_signal_handlers_block_by_func(pos_y, position_spin_changed, form);
+  gtk_spin_button_set_value(pos_x, x);
+  gtk_spin_button_set_value(pos_y, y);
+  g_signal_handlers_unblock_by_func(pos_x, position_spin_changed, form);
+  g_signal_handlers_unblock_by_func(pos_y, position_spin_changed, form);
+
+  if (gtk_spin_button_get_value(pos_x) != old_x
+      || gtk_spin_button_get_value(pos_y) != old_y)
+    g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_POSITION);
 }
@@ -32,25 +32,19 @@ struct _WdHeadFormClass {
 
 struct wd_head;
 struct wd_head_config;
-
-typedef struct _WdHeadDimensions {
-  gdouble x;
-  gdouble y;
-  gdouble w;
-  gdouble h;
-  gdouble scale;
-  int rotation_id;
-  gboolean flipped;
-} WdHeadDimensions;
+struct wd_head_layout;
 
 GtkWidget *wd_head_form_new(void);
 
 gboolean wd_head_form_get_enabled(WdHeadForm *form);
-gboolean wd_head_form_has_changes(WdHeadForm *form, const struct wd_head *head);
+enum wd_head_fields wd_head_layout_get_changes(
+    const struct wd_head_layout *layout, const struct wd_head *head);
 void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
     enum wd_head_fields fields);
 void wd_head_form_fill_config(WdHeadForm *form, struct wd_head_config *output);
-void wd_head_form_get_dimensions(WdHeadForm *form, WdHeadDimensions *dimensions);
+void wd_head_form_update_modes(WdHeadForm *form, const struct wd_head *head);
+void wd_head_form_set_invalid(WdHeadForm *form, enum wd_head_fields fields);
+void wd_head_form_get_layout(WdHeadForm *form, struct wd_head_layout *layout);
 void wd_head_form_set_position(WdHeadForm *form, double x, double y);
 
 G_END_DECLS
@@ -3,6 +3,7 @@
 
 #include <gtk/gtk.h>
 #include <gdk/gdkwayland.h>
+#include <glib-unix.h>
 
 #include "wdisplays.h"
 #include "glviewport.h"
@@ -20,22 +21,41 @@ __attribute__((noreturn)) void wd_fatal_error(int status, const char *message) {
 #define MIN_ZOOM (1./1000.)
 #define MAX_ZOOM 1000.
 #define CANVAS_MARGIN 40
+/* time the pending edits have to stay unchanged before they are tested */
+#define TEST_EDITS_DELAY_MS 250
 
 static const char *APP_PREFIX = "app";
 
-static bool has_changes(const struct wd_state *state) {
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    if (wd_head_form_has_changes(WD_HEAD_FORM(form_iter->data),
-          g_object_get_data(G_OBJECT(form_iter->data), "head")))
-      return true;
+/* set by --startup-trace, until the first frame is drawn */
+static gboolean startup_trace = FALSE;
+static int64_t startup_begin;
+static int64_t startup_last;
+
+static void trace_startup(const char *phase) {
+  if (!startup_trace)
+    return;
+  int64_t now = g_get_monotonic_time();
+  fprintf(stderr, "startup: %-12s %8.1fms %8.1fms total\n", phase,
+      (now - startup_last) / 1000., (now - startup_begin) / 1000.);
+  startup_last = now;
+}
+
+static bool has_changes(struct wd_state *state) {
+  bool changes = false;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    struct wd_head_layout *layout = &head->layout;
+    if (layout->dirty) {
+      layout->changed = head->form != NULL
+        ? wd_head_layout_get_changes(layout, head) : 0;
+      layout->dirty = 0;
+    }
+    changes = changes || layout->changed != 0;
   }
-  return false;
+  return changes;
 }
 
-static gboolean send_apply(gpointer data) {
-  struct wd_state *state = data;
-  state->apply_idle = -1;
+static struct wl_list *collect_outputs(struct wd_state *state) {
   struct wl_list *outputs = calloc(1, sizeof(*outputs));
   wl_list_init(outputs);
   g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
@@ -45,6 +65,58 @@ static gboolean send_apply(gpointer data) {
     output->head = g_object_get_data(G_OBJECT(form_iter->data), "head");
     wd_head_form_fill_config(WD_HEAD_FORM(form_iter->data), output);
   }
+  return outputs;
+}
+
+/*
+ * Marks the changed fields if the pending changes failed their test. Changes
+ * are not tested with auto-apply since they are sent right away.
+ */
+static void update_test_marks(struct wd_state *state, bool changes) {
+  bool failed = false;
+  if (changes && !state->autoapply) {
+    failed = wd_test_state(state, collect_outputs(state)) == WD_TEST_FAILED;
+  }
+  if (!failed && !state->edits_failed)
+    return;
+  state->edits_failed = failed;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    if (head->form != NULL) {
+      wd_head_form_set_invalid(WD_HEAD_FORM(head->form),
+          failed ? head->layout.changed : 0);
+    }
+  }
+}
+
+static gboolean test_edits(gpointer data) {
+  struct wd_state *state = data;
+  state->test_edits_timer = -1;
+  update_test_marks(state, has_changes(state));
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Tests the pending edits once they stop changing and no head is being
+ * dragged, instead of after every step. Marks from older edits are cleared
+ * right away.
+ */
+static void queue_test_edits(struct wd_state *state, bool changes) {
+  if (state->test_edits_timer != -1) {
+    g_source_remove(state->test_edits_timer);
+    state->test_edits_timer = -1;
+  }
+  update_test_marks(state, false);
+  if (changes && !state->autoapply && state->clicked == NULL) {
+    state->test_edits_timer =
+      g_timeout_add(TEST_EDITS_DELAY_MS, test_edits, state);
+  }
+}
+
+static gboolean send_apply(gpointer data) {
+  struct wd_state *state = data;
+  state->apply_idle = -1;
+  struct wl_list *outputs = collect_outputs(state);
   GdkWindow *window = gtk_widget_get_window(state->stack);
   GdkDisplay *display = gdk_window_get_display(window);
   struct wl_display *wl_display = gdk_wayland_display_get_wl_display(display);
@@ -84,8 +156,14 @@ static gboolean apply_done_reset(gpointer data) {
 }
 
 static void update_scroll_size(struct wd_state *state) {
-  state->render.viewport_width = gtk_widget_get_allocated_width(state->canvas);
-  state->render.viewport_height = gtk_widget_get_allocated_height(state->canvas);
+  unsigned width = gtk_widget_get_allocated_width(state->canvas);
+  unsigned height = gtk_widget_get_allocated_height(state->canvas);
+  if (width != state->render.viewport_width
+      || height != state->render.viewport_height) {
+    state->render.viewport_width = width;
+    state->render.viewport_height = height;
+    state->render.verts_dirty = TRUE;
+  }
 
   GtkAdjustment *scroll_x_adj = gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(state->scroller));
   GtkAdjustment *scroll_y_adj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(state->scroller));
@@ -114,29 +192,29 @@ static void update_canvas_size(struct wd_state *state) {
   int ymin = 0;
   int ymax = 0;
 
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *form = WD_HEAD_FORM(form_iter->data);
-    if (wd_head_form_get_enabled(form)) {
-      WdHeadDimensions dim;
-      wd_head_form_get_dimensions(form, &dim);
-      int h = dim.h;
-      int w = dim.w;
-      int x2 = dim.x + w;
-      int y2 = dim.x + h;
-      if (dim.scale > 0.) {
-        w /= dim.scale;
-        h /= dim.scale;
-      }
-      xmin = MIN(xmin, dim.x);
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    const struct wd_head_layout *layout = &head->layout;
+    if (layout->enabled) {
+      int h = layout->height;
+      int w = layout->width;
+      int x2 = layout->x + w;
+      int y2 = layout->y + h;
+      xmin = MIN(xmin, layout->x);
       xmax = MAX(xmax, x2);
-      ymin = MIN(ymin, dim.y);
+      ymin = MIN(ymin, layout->y);
       ymax = MAX(ymax, y2);
     }
   }
   // update canvas sizings
-  state->render.x_origin = floor(xmin * state->zoom) - CANVAS_MARGIN;
-  state->render.y_origin = floor(ymin * state->zoom) - CANVAS_MARGIN;
+  int x_origin = floor(xmin * state->zoom) - CANVAS_MARGIN;
+  int y_origin = floor(ymin * state->zoom) - CANVAS_MARGIN;
+  if (x_origin != state->render.x_origin
+      || y_origin != state->render.y_origin) {
+    state->render.x_origin = x_origin;
+    state->render.y_origin = y_origin;
+    state->render.verts_dirty = TRUE;
+  }
   state->render.width = ceil((xmax - xmin) * state->zoom) + CANVAS_MARGIN * 2;
   state->render.height = ceil((ymax - ymin) * state->zoom) + CANVAS_MARGIN * 2;
 
@@ -146,12 +224,22 @@ static void update_canvas_size(struct wd_state *state) {
 static void cache_scroll(struct wd_state *state) {
   GtkAdjustment *scroll_x_adj = gtk_scrolled_window_get_hadjustment(GTK_SCROLLED_WINDOW(state->scroller));
   GtkAdjustment *scroll_y_adj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(state->scroller));
-  state->render.scroll_x = gtk_adjustment_get_value(scroll_x_adj);
-  state->render.scroll_y = gtk_adjustment_get_value(scroll_y_adj);
+  int scroll_x = gtk_adjustment_get_value(scroll_x_adj);
+  int scroll_y = gtk_adjustment_get_value(scroll_y_adj);
+  if (scroll_x != state->render.scroll_x
+      || scroll_y != state->render.scroll_y) {
+    state->render.scroll_x = scroll_x;
+    state->render.scroll_y = scroll_y;
+    state->render.verts_dirty = TRUE;
+  }
 }
 
 static gboolean redraw_canvas(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data);
 
+/*
+ * The canvas is only redrawn every frame while a hover or click animation
+ * runs. Captures wake it up through capture_notified() when they are ready.
+ */
 static void update_tick_callback(struct wd_state *state) {
   bool any_animate = FALSE;
   struct wd_render_head_data *render;
@@ -162,7 +250,7 @@ static void update_tick_callback(struct wd_state *state) {
       break;
     }
   }
-  if (!any_animate && !state->capture) {
+  if (!any_animate) {
     if (state->canvas_tick != -1) {
       gtk_widget_remove_tick_callback(state->canvas, state->canvas_tick);
       state->canvas_tick = -1;
@@ -172,7 +260,66 @@ static void update_tick_callback(struct wd_state *state) {
       gtk_widget_add_tick_callback(state->canvas, redraw_canvas, state, NULL);
   }
   gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
-  gtk_gl_area_set_auto_render(GTK_GL_AREA(state->canvas), state->capture);
+}
+
+static void schedule_capture(struct wd_state *state);
+
+static gboolean capture_timeout(gpointer data) {
+  struct wd_state *state = data;
+  state->capture_timer = -1;
+  schedule_capture(state);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Queues the next captures and arms a timer for the next capture that could
+ * time out or be retried, since no redraw would happen for it otherwise.
+ */
+static void schedule_capture(struct wd_state *state) {
+  if (state->capture_timer != -1) {
+    g_source_remove(state->capture_timer);
+    state->capture_timer = -1;
+  }
+  int64_t delay = wd_capture_frame(state);
+  if (delay >= 0) {
+    state->capture_timer =
+      g_timeout_add(delay / 1000 + 1, capture_timeout, state);
+  }
+}
+
+/*
+ * Turns capturing off for good once the capture thread has given up.
+ */
+static void disable_capture(struct wd_state *state) {
+  if (state->capture_timer != -1) {
+    g_source_remove(state->capture_timer);
+    state->capture_timer = -1;
+  }
+  state->capture = FALSE;
+  GActionGroup *group = gtk_widget_get_action_group(
+      gtk_widget_get_toplevel(state->canvas), APP_PREFIX);
+  GAction *action = g_action_map_lookup_action(G_ACTION_MAP(group),
+      "capture-screens");
+  g_simple_action_set_state(G_SIMPLE_ACTION(action),
+      g_variant_new_boolean(FALSE));
+  g_simple_action_set_enabled(G_SIMPLE_ACTION(action), FALSE);
+  update_tick_callback(state);
+}
+
+static gboolean capture_notified(gint fd, GIOCondition condition,
+    gpointer data) {
+  struct wd_state *state = data;
+  if (state->capture_failed) {
+    disable_capture(state);
+    state->capture_watch = -1;
+    return G_SOURCE_REMOVE;
+  }
+  if (wd_capture_poll(state)) {
+    gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
+  } else {
+    schedule_capture(state);
+  }
+  return G_SOURCE_CONTINUE;
 }
 
 static void update_cursor(struct wd_state *state) {
@@ -233,6 +380,7 @@ static void update_hovered(struct wd_state *state,
     }
     if (init_hovered != render->hovered) {
       flip_anim(&render->hover_begin, tick);
+      state->render.verts_dirty = TRUE;
     }
   }
   update_cursor(state);
@@ -249,9 +397,14 @@ static inline void color_to_float_array(GtkStyleContext *ctx,
   out[3] = color.alpha;
 }
 
-#define SWAP(_type, _a, _b) { _type _tmp = (_a); (_a) = (_b); (_b) = _tmp; }
-
-static void queue_canvas_draw(struct wd_state *state) {
+/*
+ * Looks up the theme colors used on the canvas. They are kept until the style
+ * of the canvas changes.
+ */
+static void update_style(struct wd_state *state) {
+  if (state->render.style_valid) {
+    return;
+  }
   GtkStyleContext *style_ctx = gtk_widget_get_style_context(state->canvas);
   color_to_float_array(style_ctx,
       "theme_fg_color", state->render.fg_color);
@@ -261,36 +414,48 @@ static void queue_canvas_draw(struct wd_state *state) {
       "borders", state->render.border_color);
   color_to_float_array(style_ctx,
       "theme_selected_bg_color", state->render.selection_color);
+  state->render.style_valid = TRUE;
+  state->render.verts_dirty = TRUE;
+}
 
+#define SWAP(_type, _a, _b) { _type _tmp = (_a); (_a) = (_b); (_b) = _tmp; }
+
+static void queue_canvas_draw(struct wd_state *state) {
   cache_scroll(state);
 
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *form = WD_HEAD_FORM(form_iter->data);
-    if (wd_head_form_get_enabled(form)) {
-      WdHeadDimensions dim;
-      wd_head_form_get_dimensions(form, &dim);
-      double w = dim.w;
-      double h = dim.h;
-      double scale = dim.scale;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    const struct wd_head_layout *layout = &head->layout;
+    if (layout->enabled) {
+      double w = layout->width;
+      double h = layout->height;
+      double scale = layout->scale;
       if (scale <= 0.)
         scale = 1.;
 
-      struct wd_head *head = g_object_get_data(G_OBJECT(form_iter->data), "head");
       if (head->render == NULL) {
         head->render = calloc(1, sizeof(*head->render));
         wl_list_insert(&state->render.heads, &head->render->link);
+        state->render.verts_dirty = TRUE;
       }
       struct wd_render_head_data *render = head->render;
-      render->queued.rotation = dim.rotation_id;
+      render->queued.rotation = layout->rotation_id;
       if (render->queued.rotation & 1) {
         SWAP(int, w, h);
       }
-      render->queued.x_invert = dim.flipped;
-      render->x1 = floor(dim.x * state->zoom - state->render.scroll_x - state->render.x_origin);
-      render->y1 = floor(dim.y * state->zoom - state->render.scroll_y - state->render.y_origin);
-      render->x2 = floor(render->x1 + w * state->zoom / scale);
-      render->y2 = floor(render->y1 + h * state->zoom / scale);
+      render->queued.x_invert = layout->flipped;
+      float x1 = floor(layout->x * state->zoom - state->render.scroll_x - state->render.x_origin);
+      float y1 = floor(layout->y * state->zoom - state->render.scroll_y - state->render.y_origin);
+      float x2 = floor(x1 + w * state->zoom / scale);
+      float y2 = floor(y1 + h * state->zoom / scale);
+      if (x1 != render->x1 || y1 != render->y1
+          || x2 != render->x2 || y2 != render->y2) {
+        render->x1 = x1;
+        render->y1 = y1;
+        render->x2 = x2;
+        render->y2 = y2;
+        state->render.verts_dirty = TRUE;
+      }
     }
   }
   gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
@@ -298,7 +463,9 @@ static void queue_canvas_draw(struct wd_state *state) {
 
 static void show_apply(struct wd_state *state) {
   const gchar *page = "title";
-  if (has_changes(state)) {
+  bool changes = has_changes(state);
+  queue_test_edits(state, changes);
+  if (changes) {
     if (state->autoapply) {
       apply_state(state);
     } else {
@@ -311,16 +478,15 @@ static void show_apply(struct wd_state *state) {
 static void update_ui(WdHeadForm *form, enum wd_head_fields fields,
     gpointer data) {
   struct wd_state *state = data;
+  struct wd_head *head = g_object_get_data(G_OBJECT(form), "head");
+  wd_head_form_get_layout(form, &head->layout);
+  head->layout.dirty |= fields;
   show_apply(state);
   update_canvas_size(state);
   queue_canvas_draw(state);
 }
 
-void wd_ui_reset_heads(struct wd_state *state) {
-  if (state->stack == NULL) {
-    return;
-  }
-
+static void reset_stack(struct wd_state *state) {
   g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
   GList *form_iter = forms;
   struct wd_head *head;
@@ -329,16 +495,20 @@ void wd_ui_reset_heads(struct wd_state *state) {
     if (form_iter == NULL) {
       GtkWidget *form = wd_head_form_new();;
       g_object_set_data(G_OBJECT(form), "head", head);
+      head->form = form;
       g_signal_connect(form, "changed", G_CALLBACK(update_ui), state);
       g_autofree gchar *page_name = g_strdup_printf("%d", i);
       gtk_stack_add_titled(GTK_STACK(state->stack), form, page_name, head->name);
       wd_head_form_update(WD_HEAD_FORM(form), head, WD_FIELDS_ALL);
+      head->pending_fields = 0;
     } else {
       GtkWidget *form = GTK_WIDGET(form_iter->data);
+      head->form = form;
       if (head != g_object_get_data(G_OBJECT(form), "head")) {
         g_object_set_data(G_OBJECT(form), "head", head);
         gtk_container_child_set(GTK_CONTAINER(state->stack), form, "title", head->name, NULL);
         wd_head_form_update(WD_HEAD_FORM(form), head, WD_FIELDS_ALL);
+        head->pending_fields = 0;
       }
       form_iter = form_iter->next;
     }
@@ -348,6 +518,28 @@ void wd_ui_reset_heads(struct wd_state *state) {
   for (; form_iter != NULL; form_iter = form_iter->next) {
     gtk_container_remove(GTK_CONTAINER(state->stack), GTK_WIDGET(form_iter->data));
   }
+}
+
+void wd_ui_reset_heads(struct wd_state *state) {
+  struct wd_head *head;
+  if (state->stack == NULL) {
+    wl_list_for_each(head, &state->heads, link) {
+      head->pending_fields = 0;
+    }
+    return;
+  }
+
+  reset_stack(state);
+  wl_list_for_each(head, &state->heads, link) {
+    enum wd_head_fields fields = head->pending_fields;
+    if (fields == 0)
+      continue;
+    if (fields & WD_FIELD_NAME)
+      gtk_container_child_set(GTK_CONTAINER(state->stack), head->form, "title", head->name, NULL);
+    wd_head_form_update(WD_HEAD_FORM(head->form), head, fields);
+    head->pending_fields = 0;
+  }
+  state->stats.head_updates++;
   update_canvas_size(state);
   queue_canvas_draw(state);
 }
@@ -367,18 +559,20 @@ void wd_ui_reset_head(const struct wd_head *head, enum wd_head_fields fields) {
       break;
     }
   }
+  head->state->stats.head_updates++;
   update_canvas_size(head->state);
   queue_canvas_draw(head->state);
 }
 
 void wd_ui_reset_all(struct wd_state *state) {
-  wd_ui_reset_heads(state);
+  reset_stack(state);
   g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
   for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
     GtkWidget *form = GTK_WIDGET(form_iter->data);
     struct wd_head *head = g_object_get_data(G_OBJECT(form), "head");
     gtk_container_child_set(GTK_CONTAINER(state->stack), form, "title", head->name, NULL);
     wd_head_form_update(WD_HEAD_FORM(form_iter->data), head, WD_FIELDS_ALL);
+    head->pending_fields = 0;
   }
   update_canvas_size(state);
   queue_canvas_draw(state);
@@ -402,6 +596,33 @@ void wd_ui_apply_done(struct wd_state *state, struct wl_list *outputs) {
       apply_done_reset, state, NULL);
 }
 
+static gboolean test_done_update(gpointer data) {
+  struct wd_state *state = data;
+  state->test_idle = -1;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    if (head->tests_changed && head->form != NULL) {
+      wd_head_form_update_modes(WD_HEAD_FORM(head->form), head);
+      head->tests_changed = false;
+    }
+  }
+  /* edits changed since the result came in will be tested again */
+  if (state->edits_tested && state->test_edits_timer == -1
+      && state->clicked == NULL) {
+    state->edits_tested = false;
+    update_test_marks(state, has_changes(state));
+  }
+  return FALSE;
+}
+
+void wd_ui_test_done(struct wd_state *state) {
+  /* tests of all modes complete in a burst, so update once */
+  if (state->stack != NULL && state->test_idle == -1) {
+    state->test_idle = g_idle_add_full(G_PRIORITY_DEFAULT,
+        test_done_update, state, NULL);
+  }
+}
+
 void wd_ui_show_error(struct wd_state *state, const char *message) {
   gtk_label_set_text(GTK_LABEL(state->info_label), message);
   gtk_widget_show(state->info_bar);
@@ -415,6 +636,14 @@ static void cleanup(GtkWidget *window, gpointer data) {
     g_source_remove(state->reset_idle);
   if (state->apply_idle != -1)
     g_source_remove(state->apply_idle);
+  if (state->test_idle != -1)
+    g_source_remove(state->test_idle);
+  if (state->test_edits_timer != -1)
+    g_source_remove(state->test_edits_timer);
+  if (state->capture_timer != -1)
+    g_source_remove(state->capture_timer);
+  if (state->capture_watch != -1)
+    g_source_remove(state->capture_watch);
   g_object_unref(state->grab_cursor);
   g_object_unref(state->grabbing_cursor);
   g_object_unref(state->move_cursor);
@@ -422,8 +651,13 @@ static void cleanup(GtkWidget *window, gpointer data) {
 }
 
 static void monitor_added(GdkDisplay *display, GdkMonitor *monitor, gpointer data) {
+  struct wd_state *state = data;
   struct wl_display *wl_display = gdk_wayland_display_get_wl_display(display);
-  wd_add_output(data, gdk_wayland_monitor_get_wl_output(monitor), wl_display);
+  wd_add_output(state, gdk_wayland_monitor_get_wl_output(monitor));
+  if (state->layer_shell != NULL && state->show_overlay) {
+    wl_display_roundtrip(wl_display);
+    wd_create_overlays(state);
+  }
 }
 
 static void monitor_removed(GdkDisplay *display, GdkMonitor *monitor, gpointer data) {
@@ -516,41 +750,67 @@ static cairo_surface_t *draw_head(PangoContext *pango,
   return surface;
 }
 
+/*
+ * Computes how many device pixels the given part of a head covers on the
+ * canvas, in the orientation of its texture.
+ */
+static void target_size(const struct wd_render_head_data *render,
+    const struct wd_fbox *region, uint8_t rotation, int scale,
+    unsigned *width, unsigned *height) {
+  *width = (render->x2 - render->x1) * scale * (region->x2 - region->x1);
+  *height = (render->y2 - render->y1) * scale * (region->y2 - region->y1);
+  if (rotation & 1) {
+    SWAP(unsigned, *width, *height);
+  }
+}
+
 static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data) {
   struct wd_state *state = data;
+  if (startup_trace) {
+    trace_startup("first frame");
+    startup_trace = FALSE;
+  }
 
   PangoContext *pango = gtk_widget_get_pango_context(state->canvas);
   GdkFrameClock *clock = gtk_widget_get_frame_clock(state->canvas);
   uint64_t tick = gdk_frame_clock_get_frame_time(clock);
+  int scale = gtk_widget_get_scale_factor(state->canvas);
 
-  wd_capture_frame(state);
+  update_style(state);
+  schedule_capture(state);
 
   struct wd_head *head;
   wl_list_for_each(head, &state->heads, link) {
     struct wd_render_head_data *render = head->render;
     struct wd_output *output = wd_find_output(state, head);
     struct wd_frame *frame = NULL;
-    if (output != NULL && !wl_list_empty(&output->frames)) {
-      frame = wl_container_of(output->frames.prev, frame, link);
+    if (output != NULL) {
+      frame = wd_capture_current(output);
     }
     if (render != NULL) {
-      if (state->capture && frame != NULL && frame->pixels != NULL) {
-        if (frame->tick > render->updated_at) {
-          render->tex_stride = frame->stride;
-          render->tex_width = frame->width;
-          render->tex_height = frame->height;
-          render->pixels = frame->pixels;
+      struct wd_fbox region = render->tex_region;
+      struct wd_render_head_flags active = render->active;
+      bool y_invert = render->y_invert;
+      bool swap_rgb = render->swap_rgb;
+      if (state->capture && frame != NULL) {
+        if (!frame->consumed || !render->preview) {
+          unsigned target_width, target_height;
+          target_size(render, &frame->region, render->queued.rotation, scale,
+              &target_width, &target_height);
+          wd_preview_update(render, frame, target_width, target_height,
+              !render->preview);
           render->preview = TRUE;
-          render->updated_at = tick;
+          render->generation++;
           render->y_invert = frame->y_invert;
-          render->swap_rgb = frame->swap_rgb;
+          frame->consumed = TRUE;
         }
         if (render->preview) {
           render->active.rotation = render->queued.rotation;
           render->active.x_invert = render->queued.x_invert;
         }
-      } else if (render->preview
-          || render->pixels == NULL || size_changed(render)) {
+      } else if (render->preview || render->pixels == NULL
+          || size_changed(render)
+          || render->style_generation != state->render.style_generation) {
         render->tex_width = render->x2 - render->x1;
         render->tex_height = render->y2 - render->y1;
         render->preview = FALSE;
@@ -559,14 +819,25 @@ static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data)
         }
         head->surface = draw_head(pango, &state->render, head->name,
             render->tex_width, render->tex_height);
+        render->style_generation = state->render.style_generation;
         render->pixels = cairo_image_surface_get_data(head->surface);
         render->tex_stride = cairo_image_surface_get_stride(head->surface);
-        render->updated_at = tick;
+        render->generation++;
+        render->full_damage = TRUE;
+        render->tex_region = (struct wd_fbox) { 0.f, 0.f, 1.f, 1.f };
         render->active.rotation = 0;
         render->active.x_invert = FALSE;
         render->y_invert = FALSE;
         render->swap_rgb = FALSE;
       }
+      target_size(render, &render->tex_region, render->active.rotation, scale,
+          &render->target_width, &render->target_height);
+      if (!wd_fbox_equal(&region, &render->tex_region)
+          || active.rotation != render->active.rotation
+          || active.x_invert != render->active.x_invert
+          || y_invert != render->y_invert || swap_rgb != render->swap_rgb) {
+        state->render.verts_dirty = TRUE;
+      }
     }
   }
 
@@ -583,9 +854,9 @@ static void canvas_unrealize(GtkWidget *widget, gpointer data) {
 
   GdkDisplay *gdk_display = gdk_display_get_default();
   struct wl_display *display = gdk_wayland_display_get_wl_display(gdk_display);
-  wd_capture_wait(state, display);
+  wd_capture_cancel(state, display);
 
-  wd_gl_cleanup(state->gl_data);
+  wd_gl_cleanup(state->gl_data, &state->render);
   state->gl_data = NULL;
 }
 
@@ -594,6 +865,7 @@ static void set_clicked_head(struct wd_state *state,
   GdkFrameClock *clock = gtk_widget_get_frame_clock(state->canvas);
   uint64_t tick = gdk_frame_clock_get_frame_time(clock);
   if (clicked != state->clicked) {
+    state->render.verts_dirty = TRUE;
     if (state->clicked != NULL) {
       state->clicked->clicked = FALSE;
       flip_anim(&state->clicked->click_begin, tick);
@@ -625,20 +897,19 @@ static void canvas_drag1_begin(GtkGestureDrag *drag,
     }
   }
   if (state->clicked != NULL) {
+    state->drag_delta.x = 0.;
+    state->drag_delta.y = 0.;
+    state->drag_mods = 0;
+    state->drag_begin_time = g_get_monotonic_time();
+    /* textures belong to the heads, so this only changes the draw order */
     wl_list_remove(&state->clicked->link);
     wl_list_insert(&state->render.heads, &state->clicked->link);
-
-    struct wd_render_head_data *render;
-    wl_list_for_each(render, &state->render.heads, link) {
-      render->updated_at = 0;
-      render->preview = TRUE;
-    }
+    state->render.verts_dirty = TRUE;
     gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
-    g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-    for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-      const struct wd_head *other = g_object_get_data(G_OBJECT(form_iter->data), "head");
-      if (state->clicked == other->render) {
-        gtk_stack_set_visible_child(GTK_STACK(state->stack), form_iter->data);
+    struct wd_head *head;
+    wl_list_for_each(head, &state->heads, link) {
+      if (state->clicked == head->render && head->form != NULL) {
+        gtk_stack_set_visible_child(GTK_STACK(state->stack), head->form);
         break;
       }
     }
@@ -647,37 +918,32 @@ static void canvas_drag1_begin(GtkGestureDrag *drag,
 
 #define SNAP_DIST 6.
 
-static void canvas_drag1_update(GtkGestureDrag *drag,
-    gdouble delta_x, gdouble delta_y, gpointer data) {
-  struct wd_state *state = data;
-
+static void move_clicked_head(struct wd_state *state) {
   if (state->clicked == NULL)
     return;
-  WdHeadForm *form = NULL;
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    const struct wd_head *other = g_object_get_data(G_OBJECT(form_iter->data), "head");
-    if (state->clicked == other->render) {
-      form = WD_HEAD_FORM(form_iter->data);
+  struct wd_head *head = NULL;
+  struct wd_head *other;
+  wl_list_for_each(other, &state->heads, link) {
+    if (state->clicked == other->render && other->form != NULL) {
+      head = other;
       break;
     }
   }
-  if (!form)
+  if (!head)
     return;
-  WdHeadDimensions dim;
-  wd_head_form_get_dimensions(form, &dim);
-  struct wd_point size = { .x = dim.w, .y = dim.h };
-  if (dim.scale > 0.) {
-    size.x /= dim.scale;
-    size.y /= dim.scale;
-  }
-  if (dim.rotation_id & 1) {
+  const struct wd_head_layout *layout = &head->layout;
+  struct wd_point size = { .x = layout->width, .y = layout->height };
+  if (layout->scale > 0.) {
+    size.x /= layout->scale;
+    size.y /= layout->scale;
+  }
+  if (layout->rotation_id & 1) {
     SWAP(int, size.x, size.y);
   }
   struct wd_point tl = { /* top left */
-    .x = (state->drag_start.x + delta_x - state->head_drag_start.x * size.x * state->zoom
+    .x = (state->drag_start.x + state->drag_delta.x - state->head_drag_start.x * size.x * state->zoom
         + state->render.x_origin + state->render.scroll_x) / state->zoom,
-    .y = (state->drag_start.y + delta_y - state->head_drag_start.y * size.y * state->zoom
+    .y = (state->drag_start.y + state->drag_delta.y - state->head_drag_start.y * size.y * state->zoom
         + state->render.y_origin + state->render.scroll_y) / state->zoom
   };
 
@@ -687,26 +953,22 @@ static void canvas_drag1_update(GtkGestureDrag *drag,
   };
   struct wd_point new_pos = tl;
   float snap = SNAP_DIST / state->zoom;
-
-  GdkEvent *event = gtk_get_current_event();
-  GdkModifierType mod_state = event->motion.state;
+  GdkModifierType mod_state = state->drag_mods;
 
   /* snapping */
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *other_form = WD_HEAD_FORM(form_iter->data);
-    const struct wd_head *other = g_object_get_data(G_OBJECT(other_form), "head");
-    if (other->render != state->clicked && !(mod_state & GDK_SHIFT_MASK)) {
-      WdHeadDimensions other_dim;
-      wd_head_form_get_dimensions(other_form, &other_dim);
-      double x1 = other_dim.x;
-      double y1 = other_dim.y;
-      double w = other_dim.w;
-      double h = other_dim.h;
-      if (other_dim.scale > 0.) {
-        w /= other_dim.scale;
-        h /= other_dim.scale;
+  wl_list_for_each(other, &state->heads, link) {
+    if (other->form != NULL && other->render != state->clicked
+        && !(mod_state & GDK_SHIFT_MASK)) {
+      const struct wd_head_layout *other_layout = &other->layout;
+      double x1 = other_layout->x;
+      double y1 = other_layout->y;
+      double w = other_layout->width;
+      double h = other_layout->height;
+      if (other_layout->scale > 0.) {
+        w /= other_layout->scale;
+        h /= other_layout->scale;
       }
-      if (other_dim.rotation_id & 1) {
+      if (other_layout->rotation_id & 1) {
         SWAP(int, w, h);
       }
       double x2 = x1 + w;
@@ -738,14 +1000,55 @@ static void canvas_drag1_update(GtkGestureDrag *drag,
         new_pos.y = y2;
     }
   }
-  wd_head_form_set_position(form, new_pos.x, new_pos.y);
+  wd_head_form_set_position(WD_HEAD_FORM(head->form), new_pos.x, new_pos.y);
+  state->stats.drag_updates++;
+}
+
+static gboolean drag_tick(GtkWidget *widget, GdkFrameClock *frame_clock,
+    gpointer data) {
+  struct wd_state *state = data;
+  state->drag_tick = -1;
+  move_clicked_head(state);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Pointer motion can arrive much faster than the display refreshes, so only
+ * the latest position is kept and applied on the next frame clock tick.
+ */
+static void canvas_drag1_update(GtkGestureDrag *drag,
+    gdouble delta_x, gdouble delta_y, gpointer data) {
+  struct wd_state *state = data;
+  if (state->clicked == NULL)
+    return;
+
+  state->drag_delta.x = delta_x;
+  state->drag_delta.y = delta_y;
+  GdkEvent *event = gtk_get_current_event();
+  if (event != NULL) {
+    gdk_event_get_state(event, &state->drag_mods);
+    gdk_event_free(event);
+  }
+  state->stats.drag_motions++;
+  if (state->drag_tick == -1) {
+    state->drag_tick =
+      gtk_widget_add_tick_callback(state->canvas, drag_tick, state, NULL);
+  }
 }
 
 static void canvas_drag1_end(GtkGestureDrag *drag,
     gdouble mouse_x, gdouble mouse_y, gpointer data) {
   struct wd_state *state = data;
+  if (state->drag_tick != -1) {
+    gtk_widget_remove_tick_callback(state->canvas, state->drag_tick);
+    state->drag_tick = -1;
+    move_clicked_head(state);
+  }
+  if (state->clicked != NULL)
+    state->stats.drag_usecs += g_get_monotonic_time() - state->drag_begin_time;
   set_clicked_head(state, NULL);
   update_cursor(state);
+  queue_test_edits(state, has_changes(state));
 }
 
 static void canvas_drag2_begin(GtkGestureDrag *drag,
@@ -801,7 +1104,10 @@ static void canvas_leave(GtkEventControllerMotion *controller,
   struct wd_state *state = data;
   struct wd_render_head_data *render;
   wl_list_for_each(render, &state->render.heads, link) {
-    render->hovered = FALSE;
+    if (render->hovered) {
+      render->hovered = FALSE;
+      state->render.verts_dirty = TRUE;
+    }
   }
   update_tick_callback(state);
 }
@@ -828,10 +1134,18 @@ static gboolean canvas_scroll(GtkEventControllerScroll *controller,
   return TRUE;
 }
 
+static void canvas_style_updated(GtkWidget *widget, gpointer data) {
+  struct wd_state *state = data;
+  state->render.style_valid = FALSE;
+  state->render.style_generation++;
+  gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
+}
+
 static void canvas_resize(GtkWidget *widget, GdkRectangle *allocation,
     gpointer data) {
   struct wd_state *state = data;
   update_scroll_size(state);
+  gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
 }
 
 static void cancel_changes(GSimpleAction *action, GVariant *param, gpointer data) {
@@ -864,9 +1178,6 @@ static void auto_apply_selected(GSimpleAction *action, GVariant *param, gpointer
 
 static gboolean redraw_canvas(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data) {
   struct wd_state *state = data;
-  if (state->capture) {
-    wd_capture_frame(state);
-  }
   update_tick_callback(state);
   queue_canvas_draw(state);
   return G_SOURCE_CONTINUE;
@@ -879,6 +1190,15 @@ static void capture_selected(GSimpleAction *action, GVariant *param, gpointer da
   update_tick_callback(state);
 }
 
+static void preview_quality_selected(GSimpleAction *action, GVariant *param, gpointer data) {
+  struct wd_state *state = data;
+  const char *quality = g_variant_get_string(param, NULL);
+  state->render.preview_filter = g_strcmp0(quality, "fast") == 0
+    ? WD_PREVIEW_FILTER_BILINEAR : WD_PREVIEW_FILTER_4TAP;
+  g_simple_action_set_state(action, param);
+  gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
+}
+
 static void overlay_selected(GSimpleAction *action, GVariant *param, gpointer data) {
   struct wd_state *state = data;
   state->show_overlay = g_variant_get_boolean(param);
@@ -919,11 +1239,17 @@ static void activate(GtkApplication* app, gpointer user_data) {
     wd_fatal_error(1, "This program is only usable on Wayland sessions.");
   }
 
+  trace_startup("activate");
   struct wd_state *state = wd_state_create();
   state->zoom = DEFAULT_ZOOM;
   state->canvas_tick = -1;
   state->apply_idle = -1;
   state->reset_idle = -1;
+  state->test_idle = -1;
+  state->test_edits_timer = -1;
+  state->capture_timer = -1;
+  state->capture_watch = -1;
+  state->drag_tick = -1;
 
   GtkCssProvider *css_provider = gtk_css_provider_new();
   gtk_css_provider_load_from_resource(css_provider,
@@ -963,10 +1289,11 @@ static void activate(GtkApplication* app, gpointer user_data) {
   g_signal_connect(state->canvas, "render", G_CALLBACK(canvas_render), state);
   g_signal_connect(state->canvas, "unrealize", G_CALLBACK(canvas_unrealize), state);
   g_signal_connect(state->canvas, "size-allocate", G_CALLBACK(canvas_resize), state);
+  g_signal_connect(state->canvas, "style-updated", G_CALLBACK(canvas_style_updated), state);
   gtk_gl_area_set_required_version(GTK_GL_AREA(state->canvas), 2, 0);
   gtk_gl_area_set_use_es(GTK_GL_AREA(state->canvas), TRUE);
   gtk_gl_area_set_has_alpha(GTK_GL_AREA(state->canvas), TRUE);
-  gtk_gl_area_set_auto_render(GTK_GL_AREA(state->canvas), state->capture);
+  gtk_gl_area_set_auto_render(GTK_GL_AREA(state->canvas), FALSE);
 
   GtkGesture *canvas_drag1_controller = gtk_gesture_drag_new(state->canvas);
   GtkGesture *canvas_drag2_controller = gtk_gesture_drag_new(state->canvas);
@@ -1029,6 +1356,12 @@ static void activate(GtkApplication* app, gpointer user_data) {
   g_signal_connect(capture_action, "change-state", G_CALLBACK(capture_selected), state);
   g_action_map_add_action(G_ACTION_MAP(main_actions), G_ACTION(capture_action));
 
+  action = g_simple_action_new_stateful("preview-quality", G_VARIANT_TYPE_STRING,
+      g_variant_new_string(state->render.preview_filter == WD_PREVIEW_FILTER_BILINEAR
+        ? "fast" : "smooth"));
+  g_signal_connect(action, "change-state", G_CALLBACK(preview_quality_selected), state);
+  g_action_map_add_action(G_ACTION_MAP(main_actions), G_ACTION(action));
+
   GSimpleAction *overlay_action = g_simple_action_new_stateful("show-overlay", NULL,
       g_variant_new_boolean(state->show_overlay));
   g_signal_connect(overlay_action, "change-state", G_CALLBACK(overlay_selected), state);
@@ -1037,6 +1370,11 @@ static void activate(GtkApplication* app, gpointer user_data) {
   GMenu *main_menu = g_menu_new();
   g_menu_append(main_menu, "_Automatically Apply Changes", "app.auto-apply");
   g_menu_append(main_menu, "_Show Screen Contents", "app.capture-screens");
+  GMenu *quality_menu = g_menu_new();
+  g_menu_append(quality_menu, "_Fast", "app.preview-quality::fast");
+  g_menu_append(quality_menu, "_Smooth", "app.preview-quality::smooth");
+  g_menu_append_submenu(main_menu, "Preview _Quality", G_MENU_MODEL(quality_menu));
+  g_object_unref(quality_menu);
   g_menu_append(main_menu, "_Overlay Screen Names", "app.show-overlay");
   gtk_menu_button_set_menu_model(GTK_MENU_BUTTON(state->menu_button), G_MENU_MODEL(main_menu));
 
@@ -1045,8 +1383,10 @@ static void activate(GtkApplication* app, gpointer user_data) {
   g_autoptr(GList) info_children = gtk_container_get_children(GTK_CONTAINER(state->info_bar));
   g_signal_connect(info_children->data, "notify::child-revealed", G_CALLBACK(info_bar_animation_done), state);
 
+  trace_startup("interface");
   struct wl_display *display = gdk_wayland_display_get_wl_display(gdk_display);
   wd_add_output_management_listener(state, display);
+  trace_startup("registry");
 
   if (state->output_manager == NULL) {
     wd_fatal_error(1, "Compositor doesn't support wlr-output-management-unstable-v1");
@@ -1058,6 +1398,12 @@ static void activate(GtkApplication* app, gpointer user_data) {
     state->capture = FALSE;
     g_simple_action_set_state(capture_action, g_variant_new_boolean(state->capture));
     g_simple_action_set_enabled(capture_action, FALSE);
+  } else {
+    wd_capture_start(state, display);
+    if (state->capture_notify != -1) {
+      state->capture_watch = g_unix_fd_add(state->capture_notify, G_IO_IN,
+          capture_notified, state);
+    }
   }
   if (state->layer_shell == NULL) {
     state->show_overlay = FALSE;
@@ -1068,8 +1414,13 @@ static void activate(GtkApplication* app, gpointer user_data) {
   int n_monitors = gdk_display_get_n_monitors(gdk_display);
   for (int i = 0; i < n_monitors; i++) {
     GdkMonitor *monitor = gdk_display_get_monitor(gdk_display, i);
-    wd_add_output(state, gdk_wayland_monitor_get_wl_output(monitor), display);
+    wd_add_output(state, gdk_wayland_monitor_get_wl_output(monitor));
   }
+  /* heads, modes and the names of all outputs arrive together */
+  wl_display_roundtrip(display);
+  trace_startup("outputs");
+  wd_create_overlays(state);
+  trace_startup("overlays");
 
   g_signal_connect(gdk_display, "monitor-added", G_CALLBACK(monitor_added), state);
   g_signal_connect(gdk_display, "monitor-removed", G_CALLBACK(monitor_removed), state);
@@ -1078,12 +1429,20 @@ static void activate(GtkApplication* app, gpointer user_data) {
   gtk_widget_show_all(window);
   g_object_unref(builder);
   update_tick_callback(state);
+  trace_startup("window");
 }
 // END GLOBAL CALLBACKS
 
 int main(int argc, char *argv[]) {
+  startup_begin = startup_last = g_get_monotonic_time();
   g_setenv("GDK_GL", "gles", FALSE);
   GtkApplication *app = gtk_application_new(WDISPLAYS_APP_ID, G_APPLICATION_DEFAULT_FLAGS);
+  const GOptionEntry options[] = {
+    { "startup-trace", 0, 0, G_OPTION_ARG_NONE, &startup_trace,
+      "Print the time spent in each phase of startup", NULL },
+    { NULL }
+  };
+  g_application_add_main_option_entries(G_APPLICATION(app), options);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
   int status = g_application_run(G_APPLICATION(app), argc, argv);
   g_object_unref(app);
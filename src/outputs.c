@@ -9,13 +9,17 @@
  */
 
 #define _GNU_SOURCE
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <math.h>
+#include <time.h>
 
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -30,34 +34,181 @@
 
 extern int store_config(struct wl_list *outputs);
 
+/* captures in flight per output when damage tracking is not available */
+#define CAPTURE_IN_FLIGHT_MAX 2
+/* a plain copy that takes longer than this is assumed to be lost */
+#define CAPTURE_TIMEOUT_USECS (1000 * 1000)
+#define CAPTURE_BACKOFF_MIN_USECS (100 * 1000)
+#define CAPTURE_BACKOFF_MAX_USECS (5000 * 1000)
+/* captures without damage are compared with the previous one in tiles */
+#define CAPTURE_TILE_SIZE 64
+
 static void noop() {
   // This space is intentionally left blank
 }
 
+static uint64_t get_time_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * At most one configuration is in flight at a time. Configurations applied
+ * while waiting for the compositor replace the queued one, which is sent
+ * once the previous one is acknowledged.
+ */
 struct wd_pending_config {
   struct wd_state *state;
   struct wl_list *outputs;
+  struct wl_display *display;
+  struct zwlr_output_configuration_v1 *config;
+  uint32_t serial;
+  /* time of the oldest edit included in this configuration */
+  uint64_t edited_at;
 };
 
-static void destroy_pending(struct wd_pending_config *pending) {
+static void free_head_configs(struct wl_list *outputs) {
   struct wd_head_config *output, *tmp;
-  wl_list_for_each_safe(output, tmp, pending->outputs, link) {
+  wl_list_for_each_safe(output, tmp, outputs, link) {
     wl_list_remove(&output->link);
     free(output);
   }
-  free(pending->outputs);
+  free(outputs);
+}
+
+static void destroy_pending(struct wd_pending_config *pending) {
+  if (pending->config != NULL)
+    zwlr_output_configuration_v1_destroy(pending->config);
+  free_head_configs(pending->outputs);
   free(pending);
 }
 
+/*
+ * Larger modes come first, like compositors usually list them.
+ */
+static int compare_modes(const void *a, const void *b) {
+  const struct wd_mode *x = *(struct wd_mode * const *) a;
+  const struct wd_mode *y = *(struct wd_mode * const *) b;
+  if (x->width != y->width)
+    return x->width > y->width ? -1 : 1;
+  if (x->height != y->height)
+    return x->height > y->height ? -1 : 1;
+  if (x->refresh != y->refresh)
+    return x->refresh > y->refresh ? -1 : 1;
+  return 0;
+}
+
+/*
+ * Adds the heads to a configuration, only setting the properties that differ
+ * from the current state of each head.
+ */
+static void fill_config(struct zwlr_output_configuration_v1 *config,
+    struct wl_list *outputs) {
+  struct wd_head_config *output;
+  wl_list_for_each(output, outputs, link) {
+    struct wd_head *head = output->head;
+
+    if (!output->enabled) {
+      zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
+      continue;
+    }
+
+    struct zwlr_output_configuration_head_v1 *config_head = zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
+
+    const struct wd_mode *selected_mode = wd_head_find_mode(head,
+        output->width, output->height, output->refresh);
+    if (selected_mode != NULL) {
+      /* compared by value, the index keeps only one of several equal modes */
+      if (output->enabled != head->enabled || head->mode == NULL
+          || compare_modes(&selected_mode, &head->mode) != 0) {
+        zwlr_output_configuration_head_v1_set_mode(config_head, selected_mode->wlr_mode);
+      }
+    } else if (output->enabled != head->enabled
+        || output->width != head->custom_mode.width
+        || output->height != head->custom_mode.height
+        || output->refresh != head->custom_mode.refresh) {
+      zwlr_output_configuration_head_v1_set_custom_mode(config_head,
+          output->width, output->height, output->refresh);
+    }
+    if (output->enabled != head->enabled || output->x != head->x || output->y != head->y) {
+      zwlr_output_configuration_head_v1_set_position(config_head, output->x, output->y);
+    }
+    if (output->enabled != head->enabled || output->scale != head->scale) {
+      zwlr_output_configuration_head_v1_set_scale(config_head, wl_fixed_from_double(output->scale));
+    }
+    if (output->enabled != head->enabled || output->transform != head->transform) {
+      zwlr_output_configuration_head_v1_set_transform(config_head, output->transform);
+    }
+  }
+}
+
+static const struct zwlr_output_configuration_v1_listener config_listener;
+
+static void send_config(struct wd_pending_config *pending) {
+  struct wd_state *state = pending->state;
+  pending->serial = state->serial;
+  pending->config =
+    zwlr_output_manager_v1_create_configuration(state->output_manager, state->serial);
+  struct zwlr_output_configuration_v1 *config = pending->config;
+
+  zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+  fill_config(config, pending->outputs);
+  zwlr_output_configuration_v1_apply(config);
+  wl_display_flush(pending->display);
+  state->apply_sent = pending;
+  state->stats.apply_sent++;
+}
+
+/*
+ * Sends the queued configuration if the compositor isn't processing one.
+ */
+static void send_queued_config(struct wd_state *state) {
+  if (state->apply_sent == NULL && state->apply_queued != NULL) {
+    struct wd_pending_config *pending = state->apply_queued;
+    state->apply_queued = NULL;
+    send_config(pending);
+  }
+}
+
+/*
+ * Finishes the configuration in flight. If it may have changed the server
+ * state, the queued configuration waits for the serial of the next
+ * zwlr_output_manager_v1.done event unless that already arrived, since the
+ * compositor would only cancel it with the old one.
+ */
+static void finish_config(struct wd_pending_config *pending,
+    bool state_changed) {
+  struct wd_state *state = pending->state;
+  state->apply_sent = NULL;
+  if (!state_changed || state->serial != pending->serial)
+    send_queued_config(state);
+}
+
+/*
+ * Counts a configuration the compositor gave its final answer to.
+ */
+static void record_latency(struct wd_pending_config *pending) {
+  struct wd_state *state = pending->state;
+  uint64_t latency = get_time_usecs() - pending->edited_at;
+  state->stats.apply_acked++;
+  state->stats.apply_latency_usecs += latency;
+  state->stats.apply_latency_max = MAX(state->stats.apply_latency_max, latency);
+}
+
 static void config_handle_succeeded(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
-  zwlr_output_configuration_v1_destroy(config);
-  wd_ui_apply_done(pending->state, pending->outputs);
-  if (store_config(pending->outputs) == 0)
-  {
-    wd_ui_show_error(pending->state,
-      "Change was applied successfully and config was saved.");
+  struct wd_state *state = pending->state;
+  record_latency(pending);
+  finish_config(pending, true);
+  if (state->apply_sent == NULL && state->apply_queued == NULL) {
+    wd_ui_apply_done(state, pending->outputs);
+    if (store_config(pending->outputs) == 0)
+    {
+      wd_ui_show_error(state,
+        "Change was applied successfully and config was saved.");
+    }
   }
   destroy_pending(pending);
 }
@@ -65,21 +216,38 @@ static void config_handle_succeeded(void *data,
 static void config_handle_failed(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
-  zwlr_output_configuration_v1_destroy(config);
-  wd_ui_apply_done(pending->state, NULL);
-  wd_ui_show_error(pending->state,
-      "The display server was not able to process your changes.");
+  struct wd_state *state = pending->state;
+  record_latency(pending);
+  finish_config(pending, false);
+  if (state->apply_sent == NULL) {
+    wd_ui_apply_done(state, NULL);
+    wd_ui_show_error(state,
+        "The display server was not able to process your changes.");
+  }
   destroy_pending(pending);
 }
 
 static void config_handle_cancelled(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
-  zwlr_output_configuration_v1_destroy(config);
-  wd_ui_apply_done(pending->state, NULL);
-  wd_ui_show_error(pending->state,
-      "The display configuration was modified by the server before updates were processed. "
-      "Please check the configuration and apply the changes again.");
+  struct wd_state *state = pending->state;
+  finish_config(pending, true);
+  /* the serial has moved on since this was sent, so try again unless
+   * something newer went */
+  if (pending->serial != state->serial && state->apply_sent == NULL) {
+    zwlr_output_configuration_v1_destroy(pending->config);
+    pending->config = NULL;
+    state->apply_queued = pending;
+    send_queued_config(state);
+    return;
+  }
+  record_latency(pending);
+  if (state->apply_sent == NULL && state->apply_queued == NULL) {
+    wd_ui_apply_done(state, NULL);
+    wd_ui_show_error(state,
+        "The display configuration was modified by the server before updates were processed. "
+        "Please check the configuration and apply the changes again.");
+  }
   destroy_pending(pending);
 }
 
@@ -91,77 +259,282 @@ static const struct zwlr_output_configuration_v1_listener config_listener = {
 
 void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs,
     struct wl_display *display) {
-  struct zwlr_output_configuration_v1 *config =
-    zwlr_output_manager_v1_create_configuration(state->output_manager, state->serial);
-
   struct wd_pending_config *pending = calloc(1, sizeof(*pending));
   pending->state = state;
   pending->outputs = new_outputs;
+  pending->display = display;
+  pending->edited_at = get_time_usecs();
 
-  zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+  if (state->apply_queued != NULL) {
+    pending->edited_at = state->apply_queued->edited_at;
+    destroy_pending(state->apply_queued);
+    state->stats.apply_collapsed++;
+  }
+  state->apply_queued = pending;
+  send_queued_config(state);
+}
+
+/*
+ * Configurations are tested in the background, and the results are cached
+ * by a hash of the configuration until the server state changes.
+ */
+#define TEST_CACHE_MAX 4096
+
+struct wd_test_verdict {
+  uint64_t hash;
+  enum wd_test_result result;
+};
 
-  ssize_t i = -1;
+struct wd_test {
+  struct wl_list link;
+  struct wd_state *state;
+  /* head whose mode is tested, NULL when testing the pending edits or once
+   * the head is gone */
+  struct wd_head *head;
+  struct zwlr_output_configuration_v1 *config;
+  uint32_t serial;
+  uint64_t hash;
+};
+
+#define HASH_INIT 0xcbf29ce484222325ull
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static uint64_t hash_head_config(const struct wd_head_config *output) {
+  uint64_t hash = HASH_INIT;
+  hash = hash_bytes(hash, &output->head, sizeof(output->head));
+  hash = hash_bytes(hash, &output->enabled, sizeof(output->enabled));
+  if (output->enabled) {
+    const int32_t values[] = {
+      output->width, output->height, output->refresh,
+      output->x, output->y, output->transform
+    };
+    hash = hash_bytes(hash, values, sizeof(values));
+    hash = hash_bytes(hash, &output->scale, sizeof(output->scale));
+  }
+  return hash;
+}
+
+/*
+ * Heads are summed up so the order of the list doesn't matter.
+ */
+static uint64_t hash_config(struct wl_list *outputs) {
+  uint64_t hash = 0;
   struct wd_head_config *output;
-  wl_list_for_each(output, new_outputs, link) {
-    i++;
-    struct wd_head *head = output->head;
+  wl_list_for_each(output, outputs, link) {
+    hash += hash_head_config(output);
+  }
+  return hash;
+}
 
-    if (!output->enabled && output->enabled != head->enabled) {
-      zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
-      continue;
-    }
+static void head_config_from_head(struct wd_head_config *output,
+    struct wd_head *head) {
+  output->head = head;
+  output->enabled = head->enabled;
+  if (head->mode != NULL) {
+    output->width = head->mode->width;
+    output->height = head->mode->height;
+    output->refresh = head->mode->refresh;
+  } else {
+    output->width = head->custom_mode.width;
+    output->height = head->custom_mode.height;
+    output->refresh = head->custom_mode.refresh;
+  }
+  output->x = head->x;
+  output->y = head->y;
+  output->scale = head->scale;
+  output->transform = head->transform;
+}
 
-    struct zwlr_output_configuration_head_v1 *config_head = zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
+static struct wd_test_verdict *find_verdict(struct wd_state *state,
+    uint64_t hash) {
+  struct wd_test_verdict *verdict;
+  wl_array_for_each(verdict, &state->test_verdicts) {
+    if (verdict->hash == hash)
+      return verdict;
+  }
+  return NULL;
+}
 
-    const struct wd_mode *selected_mode = NULL;
-    const struct wd_mode *mode;
-    wl_list_for_each(mode, &head->modes, link) {
-      if (mode->width == output->width && mode->height == output->height && mode->refresh == output->refresh) {
-        selected_mode = mode;
-        break;
-      }
-    }
-    if (selected_mode != NULL) {
-      if (output->enabled != head->enabled || selected_mode != head->mode) {
-        zwlr_output_configuration_head_v1_set_mode(config_head, selected_mode->wlr_mode);
-      }
-    } else if (output->enabled != head->enabled
-        || output->width != head->custom_mode.width
-        || output->height != head->custom_mode.height
-        || output->refresh != head->custom_mode.refresh) {
-      zwlr_output_configuration_head_v1_set_custom_mode(config_head,
-          output->width, output->height, output->refresh);
-    }
-    if (output->enabled != head->enabled || output->x != head->x || output->y != head->y) {
-      zwlr_output_configuration_head_v1_set_position(config_head, output->x, output->y);
+/*
+ * Returns the result cached before.
+ */
+static enum wd_test_result set_verdict(struct wd_state *state, uint64_t hash,
+    enum wd_test_result result) {
+  struct wd_test_verdict *verdict = find_verdict(state, hash);
+  if (verdict == NULL) {
+    struct wl_array *verdicts = &state->test_verdicts;
+    if (verdicts->size >= TEST_CACHE_MAX * sizeof(*verdict)) {
+      /* forget the oldest half */
+      size_t half = verdicts->size / sizeof(*verdict) / 2 * sizeof(*verdict);
+      memmove(verdicts->data, (char *) verdicts->data + half, verdicts->size - half);
+      verdicts->size -= half;
     }
-    if (output->enabled != head->enabled || output->scale != head->scale) {
-      zwlr_output_configuration_head_v1_set_scale(config_head, wl_fixed_from_double(output->scale));
+    verdict = wl_array_add(verdicts, sizeof(*verdict));
+    if (verdict == NULL)
+      return WD_TEST_UNKNOWN;
+    verdict->hash = hash;
+    verdict->result = WD_TEST_UNKNOWN;
+  }
+  enum wd_test_result old = verdict->result;
+  verdict->result = result;
+  return old;
+}
+
+static void test_finish(struct wd_test *test, enum wd_test_result result) {
+  struct wd_state *state = test->state;
+  /* results for an older serial don't apply to the current state */
+  if (test->serial == state->serial) {
+    enum wd_test_result old = set_verdict(state, test->hash, result);
+    if (test->head == NULL) {
+      state->edits_tested = state->edits_tested || old != result;
+    } else if ((old == WD_TEST_FAILED) != (result == WD_TEST_FAILED)) {
+      /* only failures show up in the mode menu */
+      test->head->failed_modes_generation++;
+      test->head->tests_changed = true;
     }
-    if (output->enabled != head->enabled || output->transform != head->transform) {
-      zwlr_output_configuration_head_v1_set_transform(config_head, output->transform);
+  }
+  wl_list_remove(&test->link);
+  zwlr_output_configuration_v1_destroy(test->config);
+  free(test);
+  wd_ui_test_done(state);
+}
+
+static void test_handle_succeeded(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  test_finish(data, WD_TEST_PASSED);
+}
+
+static void test_handle_failed(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  test_finish(data, WD_TEST_FAILED);
+}
+
+static void test_handle_cancelled(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  test_finish(data, WD_TEST_UNKNOWN);
+}
+
+static const struct zwlr_output_configuration_v1_listener test_listener = {
+  .succeeded = test_handle_succeeded,
+  .failed = test_handle_failed,
+  .cancelled = test_handle_cancelled,
+};
+
+static void send_test(struct wd_state *state, struct wd_head *head,
+    struct wl_list *outputs, uint64_t hash) {
+  struct wd_test *test = calloc(1, sizeof(*test));
+  if (test == NULL)
+    return;
+  test->state = state;
+  test->head = head;
+  test->serial = state->serial;
+  test->hash = hash;
+  test->config =
+    zwlr_output_manager_v1_create_configuration(state->output_manager, state->serial);
+  zwlr_output_configuration_v1_add_listener(test->config, &test_listener, test);
+  fill_config(test->config, outputs);
+  zwlr_output_configuration_v1_test(test->config);
+  wl_list_insert(&state->tests, &test->link);
+  set_verdict(state, hash, WD_TEST_PENDING);
+}
+
+/*
+ * Tests every mode of every head against the current state of the others.
+ */
+static void test_modes(struct wd_state *state) {
+  int count = wl_list_length(&state->heads);
+  struct wd_head_config *outputs = calloc(count, sizeof(*outputs));
+  if (outputs == NULL)
+    return;
+  struct wl_list list;
+  wl_list_init(&list);
+  uint64_t base_hash = 0;
+  int i = 0;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    head_config_from_head(&outputs[i], head);
+    wl_list_insert(list.prev, &outputs[i].link);
+    base_hash += hash_head_config(&outputs[i]);
+    i++;
+  }
+
+  i = 0;
+  wl_list_for_each(head, &state->heads, link) {
+    struct wd_head_config *output = &outputs[i++];
+    struct wd_head_config current = *output;
+    uint64_t head_hash = hash_head_config(output);
+    struct wd_mode **indexed;
+    wl_array_for_each(indexed, &head->sorted_modes) {
+      struct wd_mode *mode = *indexed;
+      output->enabled = true;
+      output->width = mode->width;
+      output->height = mode->height;
+      output->refresh = mode->refresh;
+      mode->test_hash = base_hash - head_hash + hash_head_config(output);
+      if (find_verdict(state, mode->test_hash) == NULL)
+        send_test(state, head, &list, mode->test_hash);
     }
+    output->enabled = current.enabled;
+    output->width = current.width;
+    output->height = current.height;
+    output->refresh = current.refresh;
   }
+  free(outputs);
+}
 
-  zwlr_output_configuration_v1_apply(config);
+enum wd_test_result wd_test_state(struct wd_state *state,
+    struct wl_list *outputs) {
+  uint64_t hash = hash_config(outputs);
+  struct wd_test_verdict *verdict = find_verdict(state, hash);
+  enum wd_test_result result = verdict != NULL ? verdict->result : WD_TEST_UNKNOWN;
+  if (result == WD_TEST_UNKNOWN && state->output_manager != NULL) {
+    send_test(state, NULL, outputs, hash);
+    result = WD_TEST_PENDING;
+  }
+  free_head_configs(outputs);
+  return result;
+}
 
-  wl_display_roundtrip(display);
+enum wd_test_result wd_test_mode_result(const struct wd_mode *mode) {
+  struct wd_test_verdict *verdict = find_verdict(mode->head->state, mode->test_hash);
+  return verdict != NULL ? verdict->result : WD_TEST_UNKNOWN;
 }
 
-static void wd_frame_destroy(struct wd_frame *frame) {
-  if (frame->pixels != NULL)
-    munmap(frame->pixels, frame->height * frame->stride);
+static void wd_buffer_destroy(struct wd_buffer *buffer) {
+  if (buffer->pixels != NULL)
+    munmap(buffer->pixels, buffer->size);
+  if (buffer->wl_buffer != NULL)
+    wl_buffer_destroy(buffer->wl_buffer);
+  if (buffer->pool != NULL)
+    wl_shm_pool_destroy(buffer->pool);
+  if (buffer->fd != -1)
+    close(buffer->fd);
+
+  wl_list_remove(&buffer->link);
+  free(buffer);
+}
+
+static void wd_frame_free(struct wd_frame *frame) {
   if (frame->buffer != NULL)
-    wl_buffer_destroy(frame->buffer);
-  if (frame->pool != NULL)
-    wl_shm_pool_destroy(frame->pool);
-  if (frame->capture_fd != -1)
-    close(frame->capture_fd);
+    frame->buffer->busy = false;
+  wl_array_release(&frame->damage);
+  free(frame);
+}
+
+static void wd_frame_destroy(struct wd_frame *frame) {
   if (frame->wlr_frame != NULL)
     zwlr_screencopy_frame_v1_destroy(frame->wlr_frame);
 
   wl_list_remove(&frame->link);
-  free(frame);
+  wd_frame_free(frame);
 }
 
 static int create_shm_file(size_t size, const char *fmt, ...) {
@@ -196,6 +569,105 @@ static int create_shm_file(size_t size, const char *fmt, ...) {
   return fd;
 }
 
+static struct wd_buffer *wd_buffer_create(struct wd_output *output,
+    uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+  struct wd_buffer *buffer = calloc(1, sizeof(*buffer));
+  buffer->output = output;
+  buffer->format = format;
+  buffer->width = width;
+  buffer->height = height;
+  buffer->stride = stride;
+  buffer->size = stride * height;
+  wl_list_insert(&output->buffers, &buffer->link);
+
+  buffer->fd = create_shm_file(buffer->size, "/wd-%d-%p", getpid(),
+      (void *) buffer);
+  if (buffer->fd == -1) {
+    goto err;
+  }
+
+  buffer->pixels = mmap(NULL, buffer->size, PROT_READ, MAP_SHARED,
+      buffer->fd, 0);
+  if (buffer->pixels == MAP_FAILED) {
+    buffer->pixels = NULL;
+    fprintf(stderr, "mmap: %d: %s\n", buffer->fd, strerror(errno));
+    goto err;
+  }
+
+  buffer->pool = wl_shm_create_pool(output->state->shm, buffer->fd,
+      buffer->size);
+  buffer->wl_buffer = wl_shm_pool_create_buffer(buffer->pool, 0,
+      width, height, stride, format);
+  return buffer;
+err:
+  wd_buffer_destroy(buffer);
+  return NULL;
+}
+
+/*
+ * Finds an idle buffer matching the requested parameters, allocating a new
+ * one (or replacing a stale idle one) when none is available.
+ */
+static struct wd_buffer *wd_buffer_acquire(struct wd_output *output,
+    uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+  struct wd_buffer *buffer, *stale = NULL;
+  int count = 0;
+  wl_list_for_each(buffer, &output->buffers, link) {
+    count++;
+    if (buffer->busy) {
+      continue;
+    }
+    if (buffer->format == format && buffer->width == width
+        && buffer->height == height && buffer->stride == stride) {
+      return buffer;
+    }
+    stale = buffer;
+  }
+  if (count >= CAPTURE_BUFFERS) {
+    if (stale == NULL) {
+      return NULL;
+    }
+    wd_buffer_destroy(stale);
+  }
+  return wd_buffer_create(output, format, width, height, stride);
+}
+
+/*
+ * Holds off further captures of an output after a failure, doubling the delay
+ * with every consecutive failure.
+ */
+static void capture_backoff(struct wd_output *output, uint64_t now) {
+  unsigned shift = MIN(output->capture_failures, 6);
+  uint64_t delay = MIN((uint64_t) CAPTURE_BACKOFF_MIN_USECS << shift,
+      CAPTURE_BACKOFF_MAX_USECS);
+  output->capture_failures++;
+  output->capture_retry_at = now + delay;
+}
+
+static void output_capture(struct wd_output *output, uint64_t now);
+
+static void capture_notify(struct wd_state *state) {
+  if (state->capture_notify == -1) {
+    return;
+  }
+  uint64_t count = 1;
+  if (write(state->capture_notify, &count, sizeof(count)) == -1) {
+    fprintf(stderr, "write: %s\n", strerror(errno));
+  }
+}
+
+static void capture_copy(struct wd_frame *frame) {
+  if (frame->track_damage
+      && zwlr_screencopy_frame_v1_get_version(frame->wlr_frame)
+      >= ZWLR_SCREENCOPY_FRAME_V1_COPY_WITH_DAMAGE_SINCE_VERSION) {
+    zwlr_screencopy_frame_v1_copy_with_damage(frame->wlr_frame,
+        frame->buffer->wl_buffer);
+  } else {
+    frame->full_damage = true;
+    zwlr_screencopy_frame_v1_copy(frame->wlr_frame, frame->buffer->wl_buffer);
+  }
+}
+
 static void capture_buffer(void *data,
     struct zwlr_screencopy_frame_v1 *copy_frame,
     uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
@@ -206,28 +678,154 @@ static void capture_buffer(void *data,
     goto err;
   }
 
-  size_t size = stride * height;
-  frame->capture_fd = create_shm_file(size, "/wd-%s", frame->output->name);
-  if (frame->capture_fd == -1) {
+  frame->buffer = wd_buffer_acquire(frame->output, format, width, height,
+      stride);
+  if (frame->buffer == NULL) {
     goto err;
   }
+  frame->buffer->busy = true;
 
-  frame->pool = wl_shm_create_pool(frame->output->state->shm,
-      frame->capture_fd, size);
-  frame->buffer = wl_shm_pool_create_buffer(frame->pool, 0,
-      width, height, stride, format);
-  zwlr_screencopy_frame_v1_copy(copy_frame, frame->buffer);
   frame->stride = stride;
   frame->width = width;
   frame->height = height;
   frame->swap_rgb = format == WL_SHM_FORMAT_ABGR8888
     || format == WL_SHM_FORMAT_XBGR8888;
 
+  /* version 3 frames announce all buffer types before buffer_done */
+  if (zwlr_screencopy_frame_v1_get_version(copy_frame)
+      < ZWLR_SCREENCOPY_FRAME_V1_BUFFER_DONE_SINCE_VERSION) {
+    capture_copy(frame);
+  }
   return;
 err:
+  capture_backoff(frame->output, get_time_usecs());
   wd_frame_destroy(frame);
 }
 
+static void capture_buffer_done(void *data,
+    struct zwlr_screencopy_frame_v1 *copy_frame) {
+  struct wd_frame *frame = data;
+  if (frame->buffer == NULL) {
+    /* no shm buffer type was offered */
+    capture_backoff(frame->output, get_time_usecs());
+    wd_frame_destroy(frame);
+    return;
+  }
+  capture_copy(frame);
+}
+
+static void capture_damage(void *data,
+    struct zwlr_screencopy_frame_v1 *copy_frame,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  struct wd_frame *frame = data;
+  if (x >= frame->width || y >= frame->height) {
+    return;
+  }
+  struct wd_rect *rect = wl_array_add(&frame->damage, sizeof(*rect));
+  if (rect == NULL) {
+    frame->full_damage = true;
+    return;
+  }
+  rect->x = x;
+  rect->y = y;
+  rect->width = MIN(width, frame->width - x);
+  rect->height = MIN(height, frame->height - y);
+}
+
+/*
+ * Carries the damage of a ready frame that was never consumed by the
+ * renderer over to its replacement.
+ */
+static void merge_damage(struct wd_frame *frame, struct wd_frame *old) {
+  if (old->full_damage) {
+    frame->full_damage = true;
+  }
+  if (frame->full_damage || old->damage.size == 0) {
+    return;
+  }
+  void *rects = wl_array_add(&frame->damage, old->damage.size);
+  if (rects == NULL) {
+    frame->full_damage = true;
+    return;
+  }
+  memcpy(rects, old->damage.data, old->damage.size);
+}
+
+static void add_tile_damage(struct wd_frame *frame, unsigned row,
+    unsigned first, unsigned last) {
+  struct wd_rect *rect = wl_array_add(&frame->damage, sizeof(*rect));
+  if (rect == NULL) {
+    frame->full_damage = true;
+    return;
+  }
+  rect->x = first * CAPTURE_TILE_SIZE;
+  rect->y = row * CAPTURE_TILE_SIZE;
+  rect->width = MIN((last + 1) * CAPTURE_TILE_SIZE, frame->width) - rect->x;
+  rect->height = MIN(CAPTURE_TILE_SIZE, frame->height - rect->y);
+}
+
+/*
+ * Finds what changed in a capture that came without damage by comparing
+ * tile hashes with the previous such capture, turning changed tiles into
+ * damage. Returns false if nothing changed at all.
+ */
+static bool diff_tiles(struct wd_output *output, struct wd_frame *frame) {
+  struct wd_stats *stats = &output->state->stats;
+  unsigned cols = (frame->width + CAPTURE_TILE_SIZE - 1) / CAPTURE_TILE_SIZE;
+  unsigned rows = (frame->height + CAPTURE_TILE_SIZE - 1) / CAPTURE_TILE_SIZE;
+  bool valid = output->tile_width == frame->width
+    && output->tile_height == frame->height
+    && wd_fbox_equal(&output->tile_region, &frame->region);
+  if (!valid) {
+    free(output->tile_hashes);
+    output->tile_hashes = calloc((size_t) cols * rows, sizeof(uint64_t));
+    if (output->tile_hashes == NULL) {
+      output->tile_width = 0;
+      return true;
+    }
+    output->tile_width = frame->width;
+    output->tile_height = frame->height;
+    output->tile_region = frame->region;
+  }
+
+  uint64_t *hash = output->tile_hashes;
+  unsigned changed = 0;
+  if (valid) {
+    frame->full_damage = false;
+  }
+  for (unsigned row = 0; row < rows; row++) {
+    unsigned y = row * CAPTURE_TILE_SIZE;
+    unsigned height = MIN(CAPTURE_TILE_SIZE, frame->height - y);
+    int run = -1;
+    for (unsigned col = 0; col < cols; col++, hash++) {
+      unsigned x = col * CAPTURE_TILE_SIZE;
+      unsigned width = MIN(CAPTURE_TILE_SIZE, frame->width - x);
+      uint64_t tile = wd_hash_tile(
+          frame->pixels + (size_t) y * frame->stride + x * 4, frame->stride,
+          width, height);
+      if (valid && tile == *hash) {
+        if (run >= 0) {
+          add_tile_damage(frame, row, run, col - 1);
+          run = -1;
+        }
+        continue;
+      }
+      *hash = tile;
+      changed++;
+      if (run < 0) {
+        run = col;
+      }
+    }
+    if (valid && run >= 0) {
+      add_tile_damage(frame, row, run, cols - 1);
+    }
+  }
+
+  stats->tiles_uploaded += changed;
+  stats->tiles_skipped += (size_t) cols * rows - changed;
+  return changed > 0;
+}
+
 static void capture_flags(void *data,
     struct zwlr_screencopy_frame_v1 *wlr_frame,
     uint32_t flags) {
@@ -240,84 +838,445 @@ static void capture_ready(void *data,
     uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
   struct wd_frame *frame = data;
 
-  frame->pixels = mmap(NULL, frame->stride * frame->height,
-      PROT_READ, MAP_SHARED, frame->capture_fd, 0);
-  if (frame->pixels == MAP_FAILED) {
-    frame->pixels = NULL;
-    fprintf(stderr, "mmap: %d: %s\n", frame->capture_fd, strerror(errno));
-    wd_frame_destroy(frame);
-    return;
-  } else {
-    uint64_t tv_sec = (uint64_t) tv_sec_hi << 32 | tv_sec_lo;
-    frame->tick = (tv_sec * 1000000) + (tv_nsec / 1000);
-  }
+  frame->pixels = frame->buffer->pixels;
+  uint64_t tv_sec = (uint64_t) tv_sec_hi << 32 | tv_sec_lo;
+  frame->tick = (tv_sec * 1000000) + (tv_nsec / 1000);
 
   zwlr_screencopy_frame_v1_destroy(frame->wlr_frame);
   frame->wlr_frame = NULL;
 
-  struct wd_frame *frame_iter, *frame_tmp;
-  wl_list_for_each_safe(frame_iter, frame_tmp, &frame->output->frames, link) {
-    if (frame != frame_iter) {
-      wd_frame_destroy(frame_iter);
+  struct wd_output *output = frame->output;
+  bool changed = true;
+  if (frame->full_damage) {
+    changed = diff_tiles(output, frame);
+  } else {
+    /* the hashes go stale with captures that only cover the damage */
+    output->tile_width = 0;
+  }
+
+  /* frames are kept newest first, so everything after this one was
+   * requested earlier and is outdated now */
+  while (frame->link.next != &output->frames) {
+    struct wd_frame *old = wl_container_of(frame->link.next, old, link);
+    wd_frame_destroy(old);
+  }
+  wl_list_remove(&frame->link);
+  wl_list_init(&frame->link);
+
+  /* take back a capture the main thread hasn't picked up yet, so that its
+   * damage can be carried over before handing over the new one */
+  if (changed) {
+    struct wd_frame *old = atomic_exchange(&output->capture_slot, NULL);
+    if (old != NULL) {
+      merge_damage(frame, old);
+      wd_frame_free(old);
     }
+    atomic_store(&output->capture_slot, frame);
+  } else {
+    wd_frame_free(frame);
+  }
+
+  output->capture_failures = 0;
+  output->capture_retry_at = 0;
+  /* requeue right away so every output is captured at its own pace */
+  output_capture(output, get_time_usecs());
+  if (changed || output->capture_retry_at != 0) {
+    capture_notify(output->state);
   }
 }
 
 static void capture_failed(void *data,
     struct zwlr_screencopy_frame_v1 *wlr_frame) {
   struct wd_frame *frame = data;
+  struct wd_output *output = frame->output;
   wd_frame_destroy(frame);
+  capture_backoff(output, get_time_usecs());
+  capture_notify(output->state);
 }
 
 struct zwlr_screencopy_frame_v1_listener capture_listener = {
   .buffer = capture_buffer,
   .flags = capture_flags,
   .ready = capture_ready,
-  .failed = capture_failed
+  .failed = capture_failed,
+  .damage = capture_damage,
+  .linux_dmabuf = (void (*)(void *, struct zwlr_screencopy_frame_v1 *,
+        uint32_t, uint32_t, uint32_t))noop,
+  .buffer_done = capture_buffer_done,
 };
 
-static bool has_pending_captures(struct wd_state *state) {
+/*
+ * Computes the part of a head that is visible in the canvas viewport, both
+ * relative to the head and in output logical coordinates. Returns false if
+ * the head is entirely off-screen.
+ */
+static bool visible_region(struct wd_state *state, const struct wd_head *head,
+    struct wd_fbox *region, struct wd_rect *logical) {
+  const struct wd_render_head_data *render = head->render;
+  *region = (struct wd_fbox) { 0.f, 0.f, 1.f, 1.f };
+  logical->width = 0;
+  if (render == NULL) {
+    return true;
+  }
+
+  float w = render->x2 - render->x1;
+  float h = render->y2 - render->y1;
+  float vx1 = MAX(render->x1, 0.f);
+  float vy1 = MAX(render->y1, 0.f);
+  float vx2 = MIN(render->x2, (float) state->render.viewport_width);
+  float vy2 = MIN(render->y2, (float) state->render.viewport_height);
+  if (w <= 0.f || h <= 0.f || vx1 >= vx2 || vy1 >= vy2) {
+    return false;
+  }
+
+  /* the canvas only lines up with the output if the pending rotation and
+   * flip are the ones the output currently has */
+  if (render->queued.rotation != (head->transform & 3)
+      || render->queued.x_invert != (head->transform >= WL_OUTPUT_TRANSFORM_FLIPPED)) {
+    return true;
+  }
+  if (vx1 == render->x1 && vy1 == render->y1
+      && vx2 == render->x2 && vy2 == render->y2) {
+    return true;
+  }
+
+  double lw = head->mode != NULL ? head->mode->width : head->custom_mode.width;
+  double lh = head->mode != NULL ? head->mode->height : head->custom_mode.height;
+  if (head->scale > 0.) {
+    lw /= head->scale;
+    lh /= head->scale;
+  }
+  if (head->transform & 1) {
+    double tmp = lw;
+    lw = lh;
+    lh = tmp;
+  }
+  if (lw < 1. || lh < 1.) {
+    return true;
+  }
+
+  logical->x = floor((vx1 - render->x1) / w * lw);
+  logical->y = floor((vy1 - render->y1) / h * lh);
+  logical->width = ceil((vx2 - render->x1) / w * lw) - logical->x;
+  logical->height = ceil((vy2 - render->y1) / h * lh) - logical->y;
+  region->x1 = logical->x / lw;
+  region->y1 = logical->y / lh;
+  region->x2 = MIN((logical->x + logical->width) / lw, 1.);
+  region->y2 = MIN((logical->y + logical->height) / lh, 1.);
+  return true;
+}
+
+/*
+ * Requests the next capture of an output unless it has enough captures in
+ * flight or is backing off after failures. Each output is paced on its own,
+ * so a slow or stuck output never holds up the others.
+ */
+static void output_capture(struct wd_output *output, uint64_t now) {
+  struct wd_state *state = output->state;
+  if (state->copy_manager == NULL || !output->capture_visible
+      || now < output->capture_retry_at) {
+    return;
+  }
+  struct wd_fbox region = output->capture_target;
+  struct wd_rect logical = output->capture_logical;
+
+  /* damage is only reported relative to the previous copy, so damage-driven
+   * captures are never overlapped. They can stay pending for as long as the
+   * output is static and are only replaced when the visible part of the
+   * output changed. */
+  unsigned version = zwlr_screencopy_manager_v1_get_version(state->copy_manager);
+  unsigned max_in_flight =
+    version >= ZWLR_SCREENCOPY_FRAME_V1_COPY_WITH_DAMAGE_SINCE_VERSION
+    ? 1 : CAPTURE_IN_FLIGHT_MAX;
+  unsigned in_flight = 0;
+  struct wd_frame *frame, *frame_tmp;
+  wl_list_for_each_safe(frame, frame_tmp, &output->frames, link) {
+    if (!wd_fbox_equal(&frame->region, &region)) {
+      wd_frame_destroy(frame);
+      continue;
+    }
+    if (!frame->track_damage
+        && now - frame->requested_at > CAPTURE_TIMEOUT_USECS) {
+      wd_frame_destroy(frame);
+      capture_backoff(output, now);
+      return;
+    }
+    in_flight++;
+  }
+  if (in_flight >= max_in_flight) {
+    return;
+  }
+
+  frame = calloc(1, sizeof(*frame));
+  frame->output = output;
+  frame->region = region;
+  frame->requested_at = now;
+  frame->track_damage = in_flight == 0
+    && wd_fbox_equal(&output->capture_region, &region);
+  output->capture_region = region;
+  if (logical.width > 0) {
+    frame->wlr_frame = zwlr_screencopy_manager_v1_capture_output_region(
+        state->copy_manager, 1, output->wl_output,
+        logical.x, logical.y, logical.width, logical.height);
+  } else {
+    frame->wlr_frame =
+      zwlr_screencopy_manager_v1_capture_output(state->copy_manager, 1,
+        output->wl_output);
+  }
+  zwlr_screencopy_frame_v1_add_listener(frame->wlr_frame, &capture_listener,
+      frame);
+  wl_list_insert(&output->frames, &frame->link);
+}
+
+int64_t wd_capture_frame(struct wd_state *state) {
+  uint64_t now = get_time_usecs();
+  int64_t delay = -1;
   struct wd_output *output;
   wl_list_for_each(output, &state->outputs, link) {
+    /* the capture thread requeues from this target by itself, the head and
+     * canvas state it is derived from belong to the main thread */
+    struct wd_fbox region = { 0.f, 0.f, 1.f, 1.f };
+    struct wd_rect logical = { 0 };
+    bool visible = state->capture;
+    struct wd_head *head = wd_find_head(state, output);
+    if (visible && head != NULL) {
+      visible = visible_region(state, head, &region, &logical);
+    }
+
+    pthread_mutex_lock(&state->capture_lock);
+    output->capture_target = region;
+    output->capture_logical = logical;
+    output->capture_visible = visible;
+    output_capture(output, now);
+
+    /* nothing else would look at an output that stopped responding */
+    uint64_t deadline = output->capture_retry_at > now
+      ? output->capture_retry_at : 0;
     struct wd_frame *frame;
     wl_list_for_each(frame, &output->frames, link) {
-      if (frame->pixels == NULL) {
-        return true;
+      if (!frame->track_damage) {
+        uint64_t timeout = frame->requested_at + CAPTURE_TIMEOUT_USECS;
+        deadline = deadline == 0 ? timeout : MIN(deadline, timeout);
       }
     }
+    pthread_mutex_unlock(&state->capture_lock);
+
+    if (visible && deadline != 0) {
+      int64_t until = deadline > now ? deadline - now : 0;
+      delay = delay == -1 ? until : MIN(delay, until);
+    }
+  }
+  return delay;
+}
+
+bool wd_capture_poll(struct wd_state *state) {
+  uint64_t count;
+  if (state->capture_notify != -1
+      && read(state->capture_notify, &count, sizeof(count)) == -1
+      && errno != EAGAIN) {
+    fprintf(stderr, "read: %s\n", strerror(errno));
+  }
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    if (atomic_load(&output->capture_slot) != NULL) {
+      return true;
+    }
   }
   return false;
 }
 
-void wd_capture_frame(struct wd_state *state) {
-  if (state->copy_manager == NULL || has_pending_captures(state)
-      || !state->capture) {
+struct wd_frame *wd_capture_current(struct wd_output *output) {
+  struct wd_frame *frame = atomic_exchange(&output->capture_slot, NULL);
+  if (frame != NULL) {
+    if (output->frame != NULL) {
+      if (!output->frame->consumed) {
+        merge_damage(frame, output->frame);
+      }
+      wd_frame_free(output->frame);
+    }
+    output->frame = frame;
+  }
+  return output->frame;
+}
+
+static void *capture_thread(void *data) {
+  struct wd_state *state = data;
+  struct wl_display *display = state->capture_display;
+  struct pollfd fds[] = {
+    { .fd = wl_display_get_fd(display), .events = POLLIN },
+    { .fd = state->capture_wakeup, .events = POLLIN },
+  };
+
+  while (!state->capture_quit) {
+    bool failed = false;
+    pthread_mutex_lock(&state->capture_lock);
+    while (wl_display_prepare_read_queue(display, state->capture_queue) != 0) {
+      if (wl_display_dispatch_queue_pending(display, state->capture_queue)
+          == -1) {
+        failed = true;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&state->capture_lock);
+    if (failed) {
+      fprintf(stderr, "wl_display_dispatch_queue_pending: %s\n",
+          strerror(wl_display_get_error(display)));
+      break;
+    }
+    wl_display_flush(display);
+
+    if (poll(fds, 2, -1) == -1) {
+      wl_display_cancel_read(display);
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      if (wl_display_read_events(display) == -1) {
+        fprintf(stderr, "wl_display_read_events: %s\n", strerror(errno));
+        break;
+      }
+    } else {
+      wl_display_cancel_read(display);
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(state->capture_wakeup, &count, sizeof(count)) == -1) {
+        fprintf(stderr, "read: %s\n", strerror(errno));
+      }
+    }
+  }
+  if (!state->capture_quit) {
+    /* the connection is gone, let the main loop turn capturing off */
+    state->capture_failed = true;
+    capture_notify(state);
+  }
+  return NULL;
+}
+
+void wd_capture_start(struct wd_state *state, struct wl_display *display) {
+  state->capture_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (state->capture_wakeup == -1) {
+    fprintf(stderr, "eventfd: %s\n", strerror(errno));
     return;
   }
+  state->capture_display = display;
+  state->capture_queue = wl_display_create_queue(display);
+  /* frames inherit the queue of the manager they are created from */
+  wl_proxy_set_queue((struct wl_proxy *) state->copy_manager,
+      state->capture_queue);
+
+  int err = pthread_create(&state->capture_thread, NULL, capture_thread,
+      state);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    wl_proxy_set_queue((struct wl_proxy *) state->copy_manager, NULL);
+    wl_event_queue_destroy(state->capture_queue);
+    state->capture_queue = NULL;
+    close(state->capture_wakeup);
+    state->capture_wakeup = -1;
+  }
+}
 
-  struct wd_output *output;
-  wl_list_for_each(output, &state->outputs, link) {
-    struct wd_frame *frame = calloc(1, sizeof(*frame));
-    frame->output = output;
-    frame->capture_fd = -1;
-    frame->wlr_frame =
-      zwlr_screencopy_manager_v1_capture_output(state->copy_manager, 1,
-        output->wl_output);
-    zwlr_screencopy_frame_v1_add_listener(frame->wlr_frame, &capture_listener,
-        frame);
-    wl_list_insert(&output->frames, &frame->link);
+static void capture_stop(struct wd_state *state) {
+  if (state->capture_queue == NULL) {
+    return;
+  }
+  state->capture_quit = true;
+  uint64_t count = 1;
+  if (write(state->capture_wakeup, &count, sizeof(count)) == -1) {
+    fprintf(stderr, "write: %s\n", strerror(errno));
+  }
+  pthread_join(state->capture_thread, NULL);
+  close(state->capture_wakeup);
+  state->capture_wakeup = -1;
+}
+
+/*
+ * Heads and outputs are matched by name. Both are indexed by name, and a
+ * matched pair points at each other until either is destroyed or renamed.
+ */
+static void link_head(struct wd_head *head, struct wd_output *output) {
+  if (head->output == output)
+    return;
+  if (head->output != NULL)
+    head->output->head = NULL;
+  if (output->head != NULL)
+    output->head->output = NULL;
+  head->output = output;
+  output->head = head;
+}
+
+static void unlink_head(struct wd_head *head) {
+  if (head->output != NULL) {
+    head->output->head = NULL;
+    head->output = NULL;
   }
 }
 
+static void unlink_output(struct wd_output *output) {
+  if (output->head != NULL) {
+    output->head->output = NULL;
+    output->head = NULL;
+  }
+}
+
+static void index_remove(GHashTable *index, const char *name, void *value) {
+  if (name != NULL && g_hash_table_lookup(index, name) == value)
+    g_hash_table_remove(index, name);
+}
+
+static void set_head_name(struct wd_head *head, const char *name) {
+  struct wd_state *state = head->state;
+  index_remove(state->heads_by_name, head->name, head);
+  unlink_head(head);
+  free(head->name);
+  head->name = strdup(name);
+  g_hash_table_insert(state->heads_by_name, head->name, head);
+  struct wd_output *output = g_hash_table_lookup(state->outputs_by_name, name);
+  if (output != NULL)
+    link_head(head, output);
+}
+
+static void set_output_name(struct wd_output *output, const char *name) {
+  struct wd_state *state = output->state;
+  index_remove(state->outputs_by_name, output->name, output);
+  unlink_output(output);
+  free(output->name);
+  output->name = strdup(name);
+  g_hash_table_insert(state->outputs_by_name, output->name, output);
+  struct wd_head *head = g_hash_table_lookup(state->heads_by_name, name);
+  if (head != NULL)
+    link_head(head, output);
+}
+
 static void wd_output_destroy(struct wd_output *output) {
+  pthread_mutex_lock(&output->state->capture_lock);
   struct wd_frame *frame, *frame_tmp;
   wl_list_for_each_safe(frame, frame_tmp, &output->frames, link) {
     wd_frame_destroy(frame);
   }
+  frame = atomic_exchange(&output->capture_slot, NULL);
+  if (frame != NULL) {
+    wd_frame_free(frame);
+  }
+  if (output->frame != NULL) {
+    wd_frame_free(output->frame);
+  }
+  struct wd_buffer *buffer, *buffer_tmp;
+  wl_list_for_each_safe(buffer, buffer_tmp, &output->buffers, link) {
+    wd_buffer_destroy(buffer);
+  }
+  free(output->tile_hashes);
+  pthread_mutex_unlock(&output->state->capture_lock);
   if (output->state->layer_shell != NULL) {
     wd_destroy_overlay(output);
   }
   zxdg_output_v1_destroy(output->xdg_output);
+  index_remove(output->state->outputs_by_name, output->name, output);
+  unlink_output(output);
   free(output->name);
   free(output);
 }
@@ -328,11 +1287,21 @@ static void wd_mode_destroy(struct wd_mode* mode) {
 }
 
 static void wd_head_destroy(struct wd_head *head) {
+  struct wd_test *test;
+  wl_list_for_each(test, &head->state->tests, link) {
+    if (test->head == head)
+      test->head = NULL;
+  }
+  index_remove(head->state->heads_by_name, head->name, head);
+  unlink_head(head);
   if (head->state->clicked == head->render) {
     head->state->clicked = NULL;
   }
   if (head->render != NULL) {
     wl_list_remove(&head->render->link);
+    wd_gl_release_head(&head->state->render, head->render);
+    wl_array_release(&head->render->scaled_damage);
+    free(head->render->scaled);
     free(head->render);
     head->render = NULL;
   }
@@ -341,34 +1310,111 @@ static void wd_head_destroy(struct wd_head *head) {
     zwlr_output_mode_v1_destroy(mode->wlr_mode);
     free(mode);
   }
+  wl_array_release(&head->sorted_modes);
   zwlr_output_head_v1_destroy(head->wlr_head);
   free(head->name);
   free(head->description);
   free(head);
 }
 
+/*
+ * Rebuilds the sorted mode array of a head, keeping one mode per size and
+ * refresh rate: the current mode if it is one of them, otherwise preferably
+ * the preferred one.
+ */
+static void index_modes(struct wd_head *head) {
+  struct wl_array *sorted = &head->sorted_modes;
+  sorted->size = 0;
+  head->preferred_mode = NULL;
+  struct wd_mode *mode;
+  wl_list_for_each(mode, &head->modes, link) {
+    struct wd_mode **entry = wl_array_add(sorted, sizeof(*entry));
+    if (entry == NULL)
+      break;
+    *entry = mode;
+  }
+
+  size_t count = sorted->size / sizeof(struct wd_mode *);
+  struct wd_mode **modes = sorted->data;
+  if (count > 1)
+    qsort(modes, count, sizeof(*modes), compare_modes);
+  size_t kept = 0;
+  for (size_t i = 0, end; i < count; i = end) {
+    struct wd_mode *keep = modes[i];
+    bool preferred = false;
+    for (end = i; end < count
+        && compare_modes(&modes[i], &modes[end]) == 0; end++) {
+      preferred = preferred || modes[end]->preferred;
+      if (modes[end] == head->mode
+          || (modes[end]->preferred && keep != head->mode))
+        keep = modes[end];
+    }
+    if (preferred && head->preferred_mode == NULL)
+      head->preferred_mode = keep;
+    modes[kept++] = keep;
+  }
+  sorted->size = kept * sizeof(*modes);
+  head->modes_generation = ++head->state->modes_generation;
+  head->modes_changed = false;
+}
+
+struct wd_mode *wd_head_find_mode(const struct wd_head *head,
+    int32_t width, int32_t height, int32_t refresh) {
+  const struct wd_mode key_mode = {
+    .width = width, .height = height, .refresh = refresh
+  };
+  const struct wd_mode *key = &key_mode;
+  struct wd_mode **found = bsearch(&key, head->sorted_modes.data,
+      head->sorted_modes.size / sizeof(*found), sizeof(*found), compare_modes);
+  return found != NULL ? *found : NULL;
+}
+
 static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
     int32_t width, int32_t height) {
   struct wd_mode *mode = data;
   mode->width = width;
   mode->height = height;
+  mode->head->pending_fields |= WD_FIELD_MODE;
+  mode->head->modes_changed = true;
 }
 
 static void mode_handle_refresh(void *data,
     struct zwlr_output_mode_v1 *wlr_mode, int32_t refresh) {
   struct wd_mode *mode = data;
   mode->refresh = refresh;
+  mode->head->pending_fields |= WD_FIELD_MODE;
+  mode->head->modes_changed = true;
 }
 
 static void mode_handle_preferred(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_mode *mode = data;
   mode->preferred = true;
+  mode->head->pending_fields |= WD_FIELD_MODE;
+  mode->head->modes_changed = true;
 }
 
 static void mode_handle_finished(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_mode *mode = data;
+  struct wd_head *head = mode->head;
+  head->pending_fields |= WD_FIELD_MODE;
+  head->modes_changed = true;
+  /* the index is rebuilt on done, but must not point at freed modes */
+  struct wl_array *sorted = &head->sorted_modes;
+  struct wd_mode **indexed;
+  wl_array_for_each(indexed, sorted) {
+    if (*indexed == mode) {
+      char *end = (char *) sorted->data + sorted->size;
+      memmove(indexed, indexed + 1, end - (char *) (indexed + 1));
+      sorted->size -= sizeof(*indexed);
+      break;
+    }
+  }
+  if (head->preferred_mode == mode)
+    head->preferred_mode = NULL;
+  if (head->mode == mode)
+    head->mode = NULL;
   wl_list_remove(&mode->link);
   wd_mode_destroy(mode);
 }
@@ -383,15 +1429,15 @@ static const struct zwlr_output_mode_v1_listener mode_listener = {
 static void head_handle_name(void *data,
     struct zwlr_output_head_v1 *wlr_head, const char *name) {
   struct wd_head *head = data;
-  head->name = strdup(name);
-  wd_ui_reset_head(head, WD_FIELD_NAME);
+  set_head_name(head, name);
+  head->pending_fields |= WD_FIELD_NAME;
 }
 
 static void head_handle_description(void *data,
     struct zwlr_output_head_v1 *wlr_head, const char *description) {
   struct wd_head *head = data;
   head->description = strdup(description);
-  wd_ui_reset_head(head, WD_FIELD_DESCRIPTION);
+  head->pending_fields |= WD_FIELD_DESCRIPTION;
 }
 
 static void head_handle_physical_size(void *data,
@@ -399,7 +1445,7 @@ static void head_handle_physical_size(void *data,
   struct wd_head *head = data;
   head->phys_width = width;
   head->phys_height = height;
-  wd_ui_reset_head(head, WD_FIELD_PHYSICAL_SIZE);
+  head->pending_fields |= WD_FIELD_PHYSICAL_SIZE;
 }
 
 static void head_handle_mode(void *data,
@@ -411,6 +1457,8 @@ static void head_handle_mode(void *data,
   mode->head = head;
   mode->wlr_mode = wlr_mode;
   wl_list_insert(head->modes.prev, &mode->link);
+  head->pending_fields |= WD_FIELD_MODE;
+  head->modes_changed = true;
 
   zwlr_output_mode_v1_add_listener(wlr_mode, &mode_listener, mode);
 }
@@ -419,10 +1467,7 @@ static void head_handle_enabled(void *data,
     struct zwlr_output_head_v1 *wlr_head, int32_t enabled) {
   struct wd_head *head = data;
   head->enabled = !!enabled;
-  if (!enabled) {
-    head->output = NULL;
-  }
-  wd_ui_reset_head(head, WD_FIELD_ENABLED);
+  head->pending_fields |= WD_FIELD_ENABLED;
 }
 
 static void head_handle_current_mode(void *data,
@@ -430,10 +1475,10 @@ static void head_handle_current_mode(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_head *head = data;
   struct wd_mode *mode;
+  head->pending_fields |= WD_FIELD_MODE;
   wl_list_for_each(mode, &head->modes, link) {
     if (mode->wlr_mode == wlr_mode) {
       head->mode = mode;
-      wd_ui_reset_head(head, WD_FIELD_MODE);
       return;
     }
   }
@@ -446,21 +1491,21 @@ static void head_handle_position(void *data,
   struct wd_head *head = data;
   head->x = x;
   head->y = y;
-  wd_ui_reset_head(head, WD_FIELD_POSITION);
+  head->pending_fields |= WD_FIELD_POSITION;
 }
 
 static void head_handle_transform(void *data,
     struct zwlr_output_head_v1 *wlr_head, int32_t transform) {
   struct wd_head *head = data;
   head->transform = transform;
-  wd_ui_reset_head(head, WD_FIELD_TRANSFORM);
+  head->pending_fields |= WD_FIELD_TRANSFORM;
 }
 
 static void head_handle_scale(void *data,
     struct zwlr_output_head_v1 *wlr_head, wl_fixed_t scale) {
   struct wd_head *head = data;
   head->scale = wl_fixed_to_double(scale);
-  wd_ui_reset_head(head, WD_FIELD_SCALE);
+  head->pending_fields |= WD_FIELD_SCALE;
 }
 
 static void head_handle_finished(void *data,
@@ -506,6 +1551,7 @@ static void output_manager_handle_head(void *data,
   head->scale = 1.0;
   head->id = wl_list_length(&state->heads);
   wl_list_init(&head->modes);
+  wl_array_init(&head->sorted_modes);
   wl_list_insert(&state->heads, &head->link);
 
   zwlr_output_head_v1_add_listener(wlr_head, &head_listener, head);
@@ -514,12 +1560,15 @@ static void output_manager_handle_head(void *data,
 static void output_manager_handle_done(void *data,
     struct zwlr_output_manager_v1 *manager, uint32_t serial) {
   struct wd_state *state = data;
+  bool changed = state->serial != serial;
   state->serial = serial;
-
-  assert(wl_list_length(&state->heads) <= HEADS_MAX);
+  state->stats.manager_done++;
+  send_queued_config(state);
 
   struct wd_head *head = data;
   wl_list_for_each(head, &state->heads, link) {
+    if (head->modes_changed)
+      index_modes(head);
     if (!head->enabled && head->mode == NULL && !wl_list_empty(&head->modes)) {
       struct wd_mode *mode = wl_container_of(head->modes.prev, mode, link);
       head->custom_mode.width = mode->width;
@@ -527,6 +1576,16 @@ static void output_manager_handle_done(void *data,
       head->custom_mode.refresh = mode->refresh;
     }
   }
+  if (changed) {
+    state->test_verdicts.size = 0;
+    wl_list_for_each(head, &state->heads, link) {
+      head->failed_modes_generation++;
+      head->tests_changed = true;
+    }
+    /* modes are tested again once the configurations stop changing */
+    if (state->apply_sent == NULL && state->apply_queued == NULL)
+      test_modes(state);
+  }
   wd_ui_reset_heads(state);
 }
 
@@ -549,7 +1608,7 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
         &zxdg_output_manager_v1_interface, 2);
   } else if(strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
     state->copy_manager = wl_registry_bind(registry, name,
-        &zwlr_screencopy_manager_v1_interface, 1);
+        &zwlr_screencopy_manager_v1_interface, MIN(version, 3));
   } else if(strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
     state->layer_shell = wl_registry_bind(registry, name,
         &zwlr_layer_shell_v1_interface, 1);
@@ -567,21 +1626,12 @@ void wd_add_output_management_listener(struct wd_state *state, struct
     wl_display *display) {
   struct wl_registry *registry = wl_display_get_registry(display);
   wl_registry_add_listener(registry, &registry_listener, state);
-
-  wl_display_dispatch(display);
   wl_display_roundtrip(display);
 }
 
 struct wd_head *wd_find_head(struct wd_state *state,
     struct wd_output *output) {
-  struct wd_head *head;
-  wl_list_for_each(head, &state->heads, link) {
-    if (output->name != NULL && strcmp(output->name, head->name) == 0) {
-      head->output = output;
-      return head;
-    }
-  }
-  return NULL;
+  return output->head;
 }
 
 static void output_logical_position(void *data, struct zxdg_output_v1 *zxdg_output_v1,
@@ -598,10 +1648,7 @@ static void output_logical_position(void *data, struct zxdg_output_v1 *zxdg_outp
 static void output_name(void *data, struct zxdg_output_v1 *zxdg_output_v1,
     const char *name) {
   struct wd_output *output = data;
-  if (output->name != NULL) {
-    free(output->name);
-  }
-  output->name = strdup(name);
+  set_output_name(output, name);
   struct wd_head *head = wd_find_head(output->state, output);
   if (head != NULL) {
     wd_ui_reset_head(head, WD_FIELD_NAME);
@@ -616,19 +1663,25 @@ static const struct zxdg_output_v1_listener output_listener = {
   .description = (void (*)(void *, struct zxdg_output_v1 *, const char *))noop
 };
 
-void wd_add_output(struct wd_state *state, struct wl_output *wl_output,
-    struct wl_display *display) {
+void wd_add_output(struct wd_state *state, struct wl_output *wl_output) {
   struct wd_output *output = calloc(1, sizeof(*output));
   output->state = state;
   output->wl_output = wl_output;
   output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
       state->xdg_output_manager, wl_output);
   wl_list_init(&output->frames);
+  wl_list_init(&output->buffers);
   zxdg_output_v1_add_listener(output->xdg_output, &output_listener, output);
   wl_list_insert(output->state->outputs.prev, &output->link);
-  if (state->layer_shell != NULL && state->show_overlay) {
-    wl_display_roundtrip(display);
-    wd_create_overlay(output);
+}
+
+void wd_create_overlays(struct wd_state *state) {
+  if (state->layer_shell == NULL || !state->show_overlay)
+    return;
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    if (output->overlay_window == NULL)
+      wd_create_overlay(output);
   }
 }
 
@@ -642,7 +1695,7 @@ void wd_remove_output(struct wd_state *state, struct wl_output *wl_output,
       break;
     }
   }
-  wd_capture_wait(state, display);
+  wd_capture_cancel(state, display);
 }
 
 struct wd_output *wd_find_output(struct wd_state *state, struct wd_head
@@ -650,18 +1703,7 @@ struct wd_output *wd_find_output(struct wd_state *state, struct wd_head
   if (!head->enabled) {
     return NULL;
   }
-  if (head->output != NULL) {
-    return head->output;
-  }
-  struct wd_output *output;
-  wl_list_for_each(output, &state->outputs, link) {
-    if (output->name != NULL && strcmp(output->name, head->name) == 0) {
-      head->output = output;
-      return output;
-    }
-  }
-  head->output = NULL;
-  return NULL;
+  return head->output;
 }
 
 struct wd_state *wd_state_create(void) {
@@ -671,20 +1713,65 @@ struct wd_state *wd_state_create(void) {
   state->show_overlay = true;
   wl_list_init(&state->heads);
   wl_list_init(&state->outputs);
+  state->heads_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+  state->outputs_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+  wl_list_init(&state->tests);
+  wl_array_init(&state->test_verdicts);
   wl_list_init(&state->render.heads);
+  wl_list_init(&state->render.released_textures);
+  state->render.preview_filter = WD_PREVIEW_FILTER_4TAP;
+  pthread_mutex_init(&state->capture_lock, NULL);
+  state->capture_wakeup = -1;
+  state->capture_notify = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (state->capture_notify == -1) {
+    fprintf(stderr, "eventfd: %s\n", strerror(errno));
+  }
   return state;
 }
 
-void wd_capture_wait(struct wd_state *state, struct wl_display *display) {
-  wl_display_flush(display);
-  while (has_pending_captures(state)) {
-    if (wl_display_dispatch(display) == -1) {
-      break;
+void wd_capture_cancel(struct wd_state *state, struct wl_display *display) {
+  pthread_mutex_lock(&state->capture_lock);
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    struct wd_frame *frame, *frame_tmp;
+    wl_list_for_each_safe(frame, frame_tmp, &output->frames, link) {
+      wd_frame_destroy(frame);
     }
   }
+  pthread_mutex_unlock(&state->capture_lock);
+  wl_display_flush(display);
 }
 
 void wd_state_destroy(struct wd_state *state) {
+  capture_stop(state);
+  if (getenv("WDISPLAYS_STATS") != NULL) {
+    fprintf(stderr, "capture tiles: %" PRIu64 " uploaded, %" PRIu64
+        " skipped\n", state->stats.tiles_uploaded, state->stats.tiles_skipped);
+    fprintf(stderr, "output manager: %" PRIu64 " done events, %" PRIu64
+        " head updates\n", state->stats.manager_done, state->stats.head_updates);
+    if (state->stats.drag_usecs > 0) {
+      double secs = state->stats.drag_usecs / 1000000.;
+      fprintf(stderr, "head drags: %.1fs, %.0f motion events/s, %.0f updates/s\n",
+          secs, state->stats.drag_motions / secs, state->stats.drag_updates / secs);
+    }
+    if (state->stats.apply_acked > 0) {
+      fprintf(stderr, "apply: %" PRIu64 " sent, %" PRIu64 " collapsed, edit to"
+          " acknowledgement %.1fms average, %.1fms max\n",
+          state->stats.apply_sent, state->stats.apply_collapsed,
+          state->stats.apply_latency_usecs / 1000. / state->stats.apply_acked,
+          state->stats.apply_latency_max / 1000.);
+    }
+  }
+  if (state->apply_sent != NULL)
+    destroy_pending(state->apply_sent);
+  if (state->apply_queued != NULL)
+    destroy_pending(state->apply_queued);
+  struct wd_test *test, *test_tmp;
+  wl_list_for_each_safe(test, test_tmp, &state->tests, link) {
+    zwlr_output_configuration_v1_destroy(test->config);
+    free(test);
+  }
+  wl_array_release(&state->test_verdicts);
   struct wd_head *head, *head_tmp;
   wl_list_for_each_safe(head, head_tmp, &state->heads, link) {
     wd_head_destroy(head);
@@ -693,14 +1780,23 @@ void wd_state_destroy(struct wd_state *state) {
   wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
     wd_output_destroy(output);
   }
+  g_hash_table_destroy(state->heads_by_name);
+  g_hash_table_destroy(state->outputs_by_name);
   if (state->layer_shell != NULL) {
     zwlr_layer_shell_v1_destroy(state->layer_shell);
   }
   if (state->copy_manager != NULL) {
     zwlr_screencopy_manager_v1_destroy(state->copy_manager);
   }
+  if (state->capture_queue != NULL) {
+    wl_event_queue_destroy(state->capture_queue);
+  }
   zwlr_output_manager_v1_destroy(state->output_manager);
   zxdg_output_manager_v1_destroy(state->xdg_output_manager);
   wl_shm_destroy(state->shm);
+  if (state->capture_notify != -1) {
+    close(state->capture_notify);
+  }
+  pthread_mutex_destroy(&state->capture_lock);
   free(state);
 }
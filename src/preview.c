@@ -0,0 +1,139 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "wdisplays.h"
+#include "downscale.h"
+#include "tilehash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+unsigned wd_preview_scale_shift(unsigned src_width, unsigned src_height,
+    unsigned dst_width, unsigned dst_height) {
+  dst_width = MAX(dst_width, 1);
+  dst_height = MAX(dst_height, 1);
+  unsigned shift = 0;
+  while (shift < WD_DOWNSCALE_MAX_SHIFT
+      && src_width >> (shift + 1) >= dst_width
+      && src_height >> (shift + 1) >= dst_height) {
+    shift++;
+  }
+  return shift;
+}
+
+static const struct wd_downscale_kernel *downscale_kernel;
+
+void wd_downscale(const uint8_t *src, unsigned src_stride,
+    uint8_t *dst, unsigned dst_stride,
+    const struct wd_rect *rect, unsigned shift, bool swap_rb) {
+  if (downscale_kernel == NULL) {
+    size_t count;
+    const struct wd_downscale_kernel *const *kernels =
+      wd_downscale_kernels(&count);
+    downscale_kernel = kernels[count - 1];
+  }
+  wd_downscale_region(downscale_kernel, src, src_stride, dst, dst_stride,
+      rect->x, rect->y, rect->width, rect->height, shift, swap_rb);
+}
+
+static const struct wd_hash_kernel *hash_kernel;
+
+uint64_t wd_hash_tile(const uint8_t *src, unsigned stride,
+    unsigned width, unsigned height) {
+  if (hash_kernel == NULL) {
+    size_t count;
+    const struct wd_hash_kernel *const *kernels = wd_hash_kernels(&count);
+    hash_kernel = kernels[count - 1];
+  }
+  return wd_hash_region(hash_kernel, src, stride, width, height);
+}
+
+static inline void add_damage(struct wd_render_head_data *render,
+    const struct wd_rect *rect) {
+  struct wd_rect *copy = wl_array_add(&render->scaled_damage, sizeof(*copy));
+  if (copy == NULL) {
+    render->full_damage = true;
+    return;
+  }
+  *copy = *rect;
+}
+
+void wd_preview_update(struct wd_render_head_data *render,
+    struct wd_frame *frame, unsigned target_width, unsigned target_height,
+    bool full) {
+  unsigned shift = wd_preview_scale_shift(frame->width, frame->height,
+      target_width, target_height);
+  unsigned width = frame->width >> shift;
+  unsigned height = frame->height >> shift;
+  /* shrunk previews are converted to RGBA while downscaling */
+  bool swap_rgb = shift > 0 || frame->swap_rgb;
+  full = full || frame->full_damage || shift != render->tex_shift
+    || swap_rgb != render->swap_rgb
+    || width != render->tex_width || height != render->tex_height
+    || !wd_fbox_equal(&frame->region, &render->tex_region);
+
+  render->tex_region = frame->region;
+  render->tex_shift = shift;
+  render->tex_width = width;
+  render->tex_height = height;
+  render->full_damage = full;
+  render->swap_rgb = swap_rgb;
+
+  if (shift == 0) {
+    render->pixels = frame->pixels;
+    render->tex_stride = frame->stride;
+    render->damage = frame->damage.data;
+    render->damage_count = frame->damage.size / sizeof(struct wd_rect);
+    return;
+  }
+
+  unsigned stride = width * 4;
+  size_t size = (size_t) stride * height;
+  if (render->scaled_size < size) {
+    free(render->scaled);
+    render->scaled = malloc(size);
+    render->scaled_size = render->scaled != NULL ? size : 0;
+    render->full_damage = true;
+  }
+  if (render->scaled == NULL) {
+    /* fall back to the unscaled frame */
+    render->tex_shift = 0;
+    render->tex_width = frame->width;
+    render->tex_height = frame->height;
+    render->swap_rgb = frame->swap_rgb;
+    render->pixels = frame->pixels;
+    render->tex_stride = frame->stride;
+    render->damage = NULL;
+    render->damage_count = 0;
+    return;
+  }
+  render->pixels = render->scaled;
+  render->tex_stride = stride;
+  render->scaled_damage.size = 0;
+
+  if (render->full_damage) {
+    struct wd_rect rect = { 0, 0, width, height };
+    wd_downscale(frame->pixels, frame->stride, render->scaled, stride,
+        &rect, shift, !frame->swap_rgb);
+  } else {
+    const int32_t mask = (1 << shift) - 1;
+    struct wd_rect *src_rect;
+    wl_array_for_each(src_rect, &frame->damage) {
+      struct wd_rect rect;
+      rect.x = src_rect->x >> shift;
+      rect.y = src_rect->y >> shift;
+      rect.width = MIN((src_rect->x + src_rect->width + mask) >> shift,
+          (int32_t) width) - rect.x;
+      rect.height = MIN((src_rect->y + src_rect->height + mask) >> shift,
+          (int32_t) height) - rect.y;
+      if (rect.width <= 0 || rect.height <= 0) {
+        continue;
+      }
+      wd_downscale(frame->pixels, frame->stride, render->scaled, stride,
+          &rect, shift, !frame->swap_rgb);
+      add_damage(render, &rect);
+    }
+  }
+  render->damage = render->scaled_damage.data;
+  render->damage_count = render->scaled_damage.size / sizeof(struct wd_rect);
+}
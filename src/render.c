@@ -5,30 +5,64 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <epoxy/gl.h>
 #include <wayland-util.h>
 
-#define BT_UV_VERT_SIZE (2 + 2)
+/* position, uv, then layer, swizzle and uv limit */
+#define BT_UV_VERT_SIZE (2 + 2 + 4)
 #define BT_UV_QUAD_SIZE (6 * BT_UV_VERT_SIZE)
-#define BT_UV_MAX (BT_COLOR_QUAD_SIZE * HEADS_MAX)
 
 #define BT_COLOR_VERT_SIZE (2 + 4)
 #define BT_COLOR_QUAD_SIZE (6 * BT_COLOR_VERT_SIZE)
-#define BT_COLOR_MAX (BT_COLOR_QUAD_SIZE * HEADS_MAX)
 
 #define BT_LINE_VERT_SIZE (2 + 4)
 #define BT_LINE_QUAD_SIZE (8 * BT_LINE_VERT_SIZE)
 #define BT_LINE_EXT_SIZE (24 * BT_LINE_VERT_SIZE)
-#define BT_LINE_MAX (BT_LINE_EXT_SIZE * (HEADS_MAX + 1))
+
+#define ARRAY_SIZE_STEP 64
+#define ARRAY_LAYERS_STEP 8
+/* previews larger than this on the canvas are drawn from their own texture */
+#define ARRAY_LAYER_MAX 1024
+/* past this the array is not used at all, 16 layers of the largest size */
+#define ARRAY_MAX_BYTES (64 << 20)
 
 enum gl_buffers {
   TEXTURE_BUFFER,
+  DOWNSAMPLE_BUFFER,
   COLOR_BUFFER,
   LINE_BUFFER,
   NUM_BUFFERS
 };
 
+/*
+ * The GL texture of a head. It stays with the head when heads are reordered,
+ * so changing the draw order never causes uploads.
+ */
+struct wd_gl_texture {
+  struct wl_list link; /* wd_render_data::released_textures */
+  GLuint texture;
+  /* size of the texture's storage */
+  unsigned width;
+  unsigned height;
+  /* generation of the head's pixels held by the texture, 0 if none */
+  uint64_t generation;
+  /* the texture shrunk to the on-canvas size, if it is smaller */
+  GLuint scaled;
+  unsigned scaled_width;
+  unsigned scaled_height;
+  uint64_t scaled_generation;
+  enum wd_preview_filter scaled_filter;
+  /* layer of the preview array holding the texture at its on-canvas size */
+  int layer;
+  unsigned layer_width;
+  unsigned layer_height;
+  uint64_t layer_generation;
+  enum wd_preview_filter layer_filter;
+  unsigned layer_serial;
+};
+
 struct wd_gl_data {
   GLuint color_program;
   GLuint color_vertex_shader;
@@ -42,16 +76,65 @@ struct wd_gl_data {
   GLuint texture_fragment_shader;
   GLuint texture_position_attribute;
   GLuint texture_uv_attribute;
+  GLuint texture_swap_attribute;
   GLuint texture_screen_size_uniform;
   GLuint texture_texture_uniform;
-  GLuint texture_color_transform_uniform;
 
-  GLuint buffers[NUM_BUFFERS];
+  GLuint array_program;
+  GLuint array_vertex_shader;
+  GLuint array_fragment_shader;
+  GLuint array_position_attribute;
+  GLuint array_uv_attribute;
+  GLuint array_layer_attribute;
+  GLuint array_swap_attribute;
+  GLuint array_limit_attribute;
+  GLuint array_screen_size_uniform;
+  GLuint array_texture_uniform;
+
+  GLuint downsample_vertex_shader;
+  GLuint downsample_fragment_shaders[WD_PREVIEW_FILTER_COUNT];
+  GLuint downsample_programs[WD_PREVIEW_FILTER_COUNT];
+  GLuint downsample_position_attributes[WD_PREVIEW_FILTER_COUNT];
+  GLuint downsample_texture_uniforms[WD_PREVIEW_FILTER_COUNT];
+  GLuint downsample_offset_uniforms[WD_PREVIEW_FILTER_COUNT];
+  GLuint framebuffer;
+
+  /* previews of all heads, one per layer, drawn with a single call */
+  GLuint array;
+  unsigned array_width;
+  unsigned array_height;
+  unsigned array_layers;
+  /* bumped when the array is reallocated and its layers are lost */
+  unsigned array_serial;
+  GLint max_texture_size;
+  GLint max_array_layers;
 
-  unsigned texture_count;
-  GLuint textures[HEADS_MAX];
+  GLuint buffers[NUM_BUFFERS];
 
-  float verts[BT_LINE_MAX];
+  /* GLES3 immutable texture storage and array textures are available */
+  bool gles3;
+
+  /* set when the texture quads have to be rebuilt for reasons of the
+   * renderer's own, like heads moving between layers */
+  bool quads_stale;
+  bool batched;
+  /* whether the hover or click animations ran on the last frame, so the
+   * vertices are rebuilt once more when they end */
+  bool hover_animating;
+  bool click_animating;
+
+  /* what was last written to each buffer, to only send what changed */
+  float *buffer_verts[NUM_BUFFERS];
+  size_t buffer_sizes[NUM_BUFFERS];
+  size_t buffer_capacities[NUM_BUFFERS];
+
+  /* scratch space, grown as heads are added */
+  float *verts;
+  size_t verts_capacity;
+  struct wd_render_head_data **heads;
+  bool *taken_layers;
+  GLuint *textures;
+  size_t heads_capacity;
 };
 
 static const char *color_vertex_shader_src = "\
@@ -77,23 +160,99 @@ static const char *texture_vertex_shader_src = "\
 precision mediump float;\n\
 attribute vec2 position;\n\
 attribute vec2 uv;\n\
+attribute float swap;\n\
 varying vec2 uv_out;\n\
+varying float swap_out;\n\
 uniform vec2 screen_size;\n\
 void main(void) {\n\
   vec2 screen_pos = (position / screen_size * 2. - 1.) * vec2(1., -1.);\n\
   gl_Position = vec4(screen_pos, 0., 1.);\n\
   uv_out = uv;\n\
+  swap_out = swap;\n\
 }";
 
 static const char *texture_fragment_shader_src = "\
 precision mediump float;\n\
 varying vec2 uv_out;\n\
+varying float swap_out;\n\
 uniform sampler2D texture;\n\
-uniform mat4 color_transform;\n\
 void main(void) {\n\
-  gl_FragColor = texture2D(texture, uv_out) * color_transform;\n\
+  vec4 color = texture2D(texture, uv_out);\n\
+  gl_FragColor = mix(color, color.bgra, swap_out);\n\
+}";
+
+static const char *array_vertex_shader_src = "\
+#version 300 es\n\
+precision mediump float;\n\
+in vec2 position;\n\
+in vec2 uv;\n\
+in float layer;\n\
+in float swap;\n\
+in vec2 limit;\n\
+out vec2 uv_out;\n\
+flat out float layer_out;\n\
+flat out float swap_out;\n\
+flat out vec2 limit_out;\n\
+uniform vec2 screen_size;\n\
+void main(void) {\n\
+  vec2 screen_pos = (position / screen_size * 2. - 1.) * vec2(1., -1.);\n\
+  gl_Position = vec4(screen_pos, 0., 1.);\n\
+  uv_out = uv;\n\
+  layer_out = layer;\n\
+  swap_out = swap;\n\
+  limit_out = limit;\n\
 }";
 
+/* the uv is clamped so that filtering never reads the unused part of a layer */
+static const char *array_fragment_shader_src = "\
+#version 300 es\n\
+precision mediump float;\n\
+precision mediump sampler2DArray;\n\
+in vec2 uv_out;\n\
+flat in float layer_out;\n\
+flat in float swap_out;\n\
+flat in vec2 limit_out;\n\
+uniform sampler2DArray previews;\n\
+out vec4 frag_color;\n\
+void main(void) {\n\
+  vec2 half_texel = .5 / vec2(textureSize(previews, 0).xy);\n\
+  vec2 uv = clamp(uv_out, half_texel, limit_out);\n\
+  vec4 color = texture(previews, vec3(uv, layer_out));\n\
+  frag_color = mix(color, color.bgra, swap_out);\n\
+}";
+
+static const char *downsample_vertex_shader_src = "\
+precision mediump float;\n\
+attribute vec2 position;\n\
+varying vec2 uv_out;\n\
+void main(void) {\n\
+  gl_Position = vec4(position, 0., 1.);\n\
+  uv_out = position * .5 + .5;\n\
+}";
+
+static const char *downsample_fragment_shader_srcs[WD_PREVIEW_FILTER_COUNT] = {
+  [WD_PREVIEW_FILTER_BILINEAR] = "\
+precision mediump float;\n\
+varying vec2 uv_out;\n\
+uniform sampler2D texture;\n\
+void main(void) {\n\
+  gl_FragColor = texture2D(texture, uv_out);\n\
+}",
+  /* four bilinear taps spread over the footprint of the output pixel */
+  [WD_PREVIEW_FILTER_4TAP] = "\
+precision mediump float;\n\
+varying vec2 uv_out;\n\
+uniform sampler2D texture;\n\
+uniform vec2 offset;\n\
+void main(void) {\n\
+  gl_FragColor = .25 * (\n\
+      texture2D(texture, uv_out + vec2(-offset.x, -offset.y)) +\n\
+      texture2D(texture, uv_out + vec2(offset.x, -offset.y)) +\n\
+      texture2D(texture, uv_out + vec2(-offset.x, offset.y)) +\n\
+      texture2D(texture, uv_out + vec2(offset.x, offset.y)));\n\
+}",
+};
+
 static GLuint gl_make_shader(GLenum type, const char *src) {
   GLuint shader = glCreateShader(type);
   glShaderSource(shader, 1, &src, NULL);
@@ -179,37 +338,69 @@ struct wd_gl_data *wd_gl_setup(void) {
       "screen_size");
   res->texture_texture_uniform = glGetUniformLocation(res->texture_program,
       "texture");
-  res->texture_color_transform_uniform = glGetUniformLocation(
-      res->texture_program, "color_transform");
-
-  glGenBuffers(NUM_BUFFERS, res->buffers);
-  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[TEXTURE_BUFFER]);
-  glBufferData(GL_ARRAY_BUFFER, BT_UV_MAX * sizeof(float),
-      NULL, GL_DYNAMIC_DRAW);
+  res->texture_swap_attribute = glGetAttribLocation(res->texture_program,
+      "swap");
+
+  res->downsample_vertex_shader = gl_make_shader(GL_VERTEX_SHADER,
+      downsample_vertex_shader_src);
+  for (int f = 0; f < WD_PREVIEW_FILTER_COUNT; f++) {
+    GLuint program = glCreateProgram();
+    res->downsample_programs[f] = program;
+    glAttachShader(program, res->downsample_vertex_shader);
+    res->downsample_fragment_shaders[f] = gl_make_shader(GL_FRAGMENT_SHADER,
+        downsample_fragment_shader_srcs[f]);
+    glAttachShader(program, res->downsample_fragment_shaders[f]);
+    gl_link_and_validate(program);
+
+    res->downsample_position_attributes[f] = glGetAttribLocation(program,
+        "position");
+    res->downsample_texture_uniforms[f] = glGetUniformLocation(program,
+        "texture");
+    res->downsample_offset_uniforms[f] = glGetUniformLocation(program,
+        "offset");
+  }
 
-  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[COLOR_BUFFER]);
-  glBufferData(GL_ARRAY_BUFFER, BT_COLOR_MAX * sizeof(float),
-      NULL, GL_DYNAMIC_DRAW);
+  res->gles3 = !epoxy_is_desktop_gl() && epoxy_gl_version() >= 30;
+
+  if (res->gles3) {
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &res->max_texture_size);
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &res->max_array_layers);
+
+    res->array_program = glCreateProgram();
+    res->array_vertex_shader = gl_make_shader(GL_VERTEX_SHADER,
+        array_vertex_shader_src);
+    glAttachShader(res->array_program, res->array_vertex_shader);
+    res->array_fragment_shader = gl_make_shader(GL_FRAGMENT_SHADER,
+        array_fragment_shader_src);
+    glAttachShader(res->array_program, res->array_fragment_shader);
+    gl_link_and_validate(res->array_program);
+
+    res->array_position_attribute = glGetAttribLocation(res->array_program,
+        "position");
+    res->array_uv_attribute = glGetAttribLocation(res->array_program, "uv");
+    res->array_layer_attribute = glGetAttribLocation(res->array_program,
+        "layer");
+    res->array_swap_attribute = glGetAttribLocation(res->array_program,
+        "swap");
+    res->array_limit_attribute = glGetAttribLocation(res->array_program,
+        "limit");
+    res->array_screen_size_uniform = glGetUniformLocation(res->array_program,
+        "screen_size");
+    res->array_texture_uniform = glGetUniformLocation(res->array_program,
+        "previews");
+  }
 
-  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[LINE_BUFFER]);
-  glBufferData(GL_ARRAY_BUFFER, BT_LINE_MAX * sizeof(float),
-      NULL, GL_DYNAMIC_DRAW);
+  /* the vertex buffers get their storage on the first upload */
+  glGenBuffers(NUM_BUFFERS, res->buffers);
+  static const float quad[] = { -1.f, -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f };
+  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[DOWNSAMPLE_BUFFER]);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+  /* the other buffers start out empty */
+  res->quads_stale = true;
 
   return res;
 }
 
-static const GLfloat TRANSFORM_RGB[16] = {
-  1, 0, 0, 0,
-  0, 1, 0, 0,
-  0, 0, 1, 0,
-  0, 0, 0, 1};
-
-static const GLfloat TRANSFORM_BGR[16] = {
-  0, 0, 1, 0,
-  0, 1, 0, 0,
-  1, 0, 0, 0,
-  0, 0, 0, 1};
-
 #define PUSH_POINT_COLOR(_start, _a, _b, _color, _alpha) \
     *((_start)++) = (_a);\
     *((_start)++) = (_b);\
@@ -218,11 +409,13 @@ static const GLfloat TRANSFORM_BGR[16] = {
     *((_start)++) = ((_color)[2]);\
     *((_start)++) = (_alpha);
 
-#define PUSH_POINT_UV(_start, _a, _b, _c, _d) \
+#define PUSH_POINT_UV(_start, _a, _b, _c, _d, _extra) \
     *((_start)++) = (_a);\
     *((_start)++) = (_b);\
     *((_start)++) = (_c);\
-    *((_start)++) = (_d);
+    *((_start)++) = (_d);\
+    memcpy((_start), (_extra), 4 * sizeof(float));\
+    (_start) += 4;
 
 static inline float lerp(float x, float y, float a) {
   return x * (1.f - a) + y * a;
@@ -247,124 +440,477 @@ static inline float ease(float d) {
   return d;
 }
 
-void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
-    uint64_t tick) {
-  unsigned int tri_verts = 0;
+static void set_texture_params(void) {
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
 
-  unsigned int head_count = wl_list_length(&info->heads);
-  if (head_count >= HEADS_MAX)
-    head_count = HEADS_MAX;
-
-  if (head_count > res->texture_count) {
-    glGenTextures(head_count - res->texture_count,
-        res->textures + res->texture_count);
-    for (int i = res->texture_count; i < head_count; i++) {
-      glBindTexture(GL_TEXTURE_2D, res->textures[i]);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-          GL_LINEAR_MIPMAP_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    }
-    glBindTexture(GL_TEXTURE_2D, 0);
-    res->texture_count = head_count;
+static struct wd_gl_texture *create_texture(void) {
+  struct wd_gl_texture *texture = calloc(1, sizeof(*texture));
+  wl_list_init(&texture->link);
+  texture->layer = -1;
+  glGenTextures(1, &texture->texture);
+  glBindTexture(GL_TEXTURE_2D, texture->texture);
+  set_texture_params();
+  return texture;
+}
+
+static void destroy_texture(struct wd_gl_texture *texture) {
+  if (texture->scaled != 0)
+    glDeleteTextures(1, &texture->scaled);
+  glDeleteTextures(1, &texture->texture);
+  wl_list_remove(&texture->link);
+  free(texture);
+}
+
+/*
+ * Gives a texture storage of the given size, leaving it bound. Immutable
+ * storage can't be resized, so on GLES3 the texture is replaced.
+ */
+static void alloc_storage(struct wd_gl_data *res, GLuint *texture,
+    unsigned width, unsigned height) {
+  if (res->gles3 || *texture == 0) {
+    GLuint old = *texture;
+    glGenTextures(1, texture);
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    set_texture_params();
+    if (old != 0)
+      glDeleteTextures(1, &old);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, *texture);
+  }
+  if (res->gles3) {
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+  } else {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+        0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
   }
+}
 
-  struct wd_render_head_data *head;
-  int i = 0;
-  wl_list_for_each_reverse(head, &info->heads, link) {
-    float *tri_ptr = res->verts + i * BT_UV_QUAD_SIZE;
-    float x1 = head->active.x_invert ? head->x2 : head->x1;
-    float y1 = head->y_invert ? head->y2 : head->y1;
-    float x2 = head->active.x_invert ? head->x1 : head->x2;
-    float y2 = head->y_invert ? head->y1 : head->y2;
+/*
+ * Makes sure the texture has storage of the given size, leaving it bound.
+ * Storage is only reallocated when the size changes.
+ */
+static void alloc_texture(struct wd_gl_data *res,
+    struct wd_gl_texture *texture, unsigned width, unsigned height) {
+  if (texture->width == width && texture->height == height)
+    return;
 
-    float sa = 0.f;
-    float sb = 1.f;
-    float sc = sb;
-    float sd = sa;
-    float ta = 0.f;
-    float tb = ta;
-    float tc = 1.f;
-    float td = tc;
-    for (int i = 0; i < head->active.rotation; i++) {
-      float tmp = sd;
-      sd = sc;
-      sc = sb;
-      sb = sa;
-      sa = tmp;
+  alloc_storage(res, &texture->texture, width, height);
+  texture->width = width;
+  texture->height = height;
+  texture->generation = 0;
+}
 
-      tmp = td;
-      td = tc;
-      tc = tb;
-      tb = ta;
-      ta = tmp;
+/*
+ * Brings the texture of a head up to date with its pixels and leaves it
+ * bound. Only the damaged regions are sent if the texture holds the previous
+ * generation of the head's pixels.
+ */
+static void update_texture(struct wd_gl_data *res,
+    struct wd_render_head_data *head) {
+  if (head->texture == NULL)
+    head->texture = create_texture();
+  struct wd_gl_texture *texture = head->texture;
+  glBindTexture(GL_TEXTURE_2D, texture->texture);
+  if (texture->generation == head->generation
+      || head->tex_width == 0 || head->tex_height == 0)
+    return;
+
+  alloc_texture(res, texture, head->tex_width, head->tex_height);
+  if (texture->generation == 0)
+    res->quads_stale = true;
+  bool full = head->full_damage || texture->generation == 0
+    || texture->generation + 1 != head->generation;
+  texture->generation = head->generation;
+  if (!full && head->damage_count == 0)
+    return;
+
+  const struct wd_rect whole = { 0, 0, head->tex_width, head->tex_height };
+  const struct wd_rect *rects = full ? &whole : head->damage;
+  size_t count = full ? 1 : head->damage_count;
+  glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, head->tex_stride / 4);
+  for (size_t r = 0; r < count; r++) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rects[r].x, rects[r].y,
+        rects[r].width, rects[r].height, GL_RGBA, GL_UNSIGNED_BYTE,
+        head->pixels + rects[r].y * head->tex_stride + rects[r].x * 4);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+}
+
+struct saved_target {
+  bool saved;
+  GLint framebuffer;
+  GLint viewport[4];
+};
+
+/*
+ * Directs rendering into a texture, or into a layer of it if it is an array.
+ * The caller's framebuffer and viewport are saved the first time so they can
+ * be restored once all passes are done. Returns false if the texture can't be
+ * rendered to.
+ */
+static bool bind_target(struct wd_gl_data *res, struct saved_target *saved,
+    GLuint texture, int layer) {
+  if (!saved->saved) {
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved->framebuffer);
+    glGetIntegerv(GL_VIEWPORT, saved->viewport);
+    saved->saved = true;
+  }
+  if (res->framebuffer == 0)
+    glGenFramebuffers(1, &res->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, res->framebuffer);
+  if (layer < 0) {
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, texture, 0);
+  } else {
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        texture, 0, layer);
+  }
+  return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+/*
+ * Draws a texture into the bottom left corner of the bound target, scaled to
+ * the given size.
+ */
+static void draw_pass(struct wd_gl_data *res, enum wd_preview_filter filter,
+    GLuint source, unsigned width, unsigned height) {
+  glViewport(0, 0, width, height);
+  glUseProgram(res->downsample_programs[filter]);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, source);
+  glUniform1i(res->downsample_texture_uniforms[filter], 0);
+  glUniform2f(res->downsample_offset_uniforms[filter],
+      .25f / width, .25f / height);
+  GLuint position = res->downsample_position_attributes[filter];
+  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[DOWNSAMPLE_BUFFER]);
+  glEnableVertexAttribArray(position);
+  glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, (void *) 0);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  glDisableVertexAttribArray(position);
+}
+
+static inline unsigned display_width(const struct wd_render_head_data *head) {
+  return MIN(MAX(head->target_width, 1), head->texture->width);
+}
+
+static inline unsigned display_height(const struct wd_render_head_data *head) {
+  return MIN(MAX(head->target_height, 1), head->texture->height);
+}
+
+/*
+ * Renders the texture of a head shrunk to its on-canvas size, which is what
+ * mipmaps were needed for otherwise. This is redone only when the texture
+ * contents, the on-canvas size or the filter change. Returns the texture to
+ * draw the head with.
+ */
+static GLuint downsample_texture(struct wd_gl_data *res,
+    struct wd_render_data *info, struct wd_render_head_data *head,
+    struct saved_target *saved) {
+  struct wd_gl_texture *texture = head->texture;
+  unsigned width = display_width(head);
+  unsigned height = display_height(head);
+  if (width == texture->width && height == texture->height)
+    return texture->texture;
+
+  enum wd_preview_filter filter = info->preview_filter;
+  if (texture->scaled != 0 && texture->scaled_width == width
+      && texture->scaled_height == height
+      && texture->scaled_generation == texture->generation
+      && texture->scaled_filter == filter)
+    return texture->scaled;
+
+  if (texture->scaled == 0 || texture->scaled_width != width
+      || texture->scaled_height != height) {
+    alloc_storage(res, &texture->scaled, width, height);
+    texture->scaled_width = width;
+    texture->scaled_height = height;
+  }
+
+  if (!bind_target(res, saved, texture->scaled, -1))
+    return texture->texture;
+  draw_pass(res, filter, texture->texture, width, height);
+
+  texture->scaled_generation = texture->generation;
+  texture->scaled_filter = filter;
+  return texture->scaled;
+}
+
+static inline unsigned round_up(unsigned value, unsigned step) {
+  return (value + step - 1) / step * step;
+}
+
+static void release_array(struct wd_gl_data *res) {
+  if (res->array == 0)
+    return;
+  glDeleteTextures(1, &res->array);
+  res->array = 0;
+  res->array_width = 0;
+  res->array_height = 0;
+  res->array_layers = 0;
+}
+
+/*
+ * Sizes the preview array for the given number of layers of the given size.
+ * It grows when it's too small, and shrinks once it's more than twice as
+ * large as needed. Its contents are lost when it has to be reallocated.
+ * Returns false if it would take more than ARRAY_MAX_BYTES.
+ */
+static bool alloc_array(struct wd_gl_data *res,
+    unsigned width, unsigned height, unsigned layers) {
+  width = MIN(round_up(width, ARRAY_SIZE_STEP),
+      (unsigned) res->max_texture_size);
+  height = MIN(round_up(height, ARRAY_SIZE_STEP),
+      (unsigned) res->max_texture_size);
+  layers = MIN(round_up(layers, ARRAY_LAYERS_STEP),
+      (unsigned) res->max_array_layers);
+  uint64_t size = (uint64_t) width * height * layers;
+  if (size * 4 > ARRAY_MAX_BYTES)
+    return false;
+
+  if (res->array != 0 && width <= res->array_width
+      && height <= res->array_height && layers <= res->array_layers
+      && size * 2 >= (uint64_t) res->array_width * res->array_height
+      * res->array_layers)
+    return true;
+
+  release_array(res);
+  glGenTextures(1, &res->array);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, res->array);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, width, height, layers);
+  res->array_width = width;
+  res->array_height = height;
+  res->array_layers = layers;
+  res->array_serial++;
+  return true;
+}
+
+static inline size_t grow_capacity(size_t capacity, size_t size) {
+  if (capacity == 0)
+    capacity = 1;
+  while (capacity < size)
+    capacity *= 2;
+  return capacity;
+}
+
+/*
+ * Makes room for the given number of floats in the vertex scratch space and
+ * the per-head tables. Returns false if memory ran out, leaving the old space
+ * as it was.
+ */
+static bool reserve_scratch(struct wd_gl_data *res, size_t verts,
+    size_t heads) {
+  if (verts > res->verts_capacity) {
+    size_t capacity = grow_capacity(res->verts_capacity, verts);
+    float *new_verts = realloc(res->verts, capacity * sizeof(float));
+    if (new_verts == NULL)
+      return false;
+    res->verts = new_verts;
+    res->verts_capacity = capacity;
+  }
+  if (heads > res->heads_capacity) {
+    size_t capacity = grow_capacity(res->heads_capacity, heads);
+    struct wd_render_head_data **new_heads = realloc(res->heads,
+        capacity * sizeof(*new_heads));
+    if (new_heads != NULL)
+      res->heads = new_heads;
+    bool *new_taken = realloc(res->taken_layers, capacity * sizeof(bool));
+    if (new_taken != NULL)
+      res->taken_layers = new_taken;
+    GLuint *new_textures = realloc(res->textures, capacity * sizeof(GLuint));
+    if (new_textures != NULL)
+      res->textures = new_textures;
+    if (new_heads == NULL || new_taken == NULL || new_textures == NULL)
+      return false;
+    res->heads_capacity = capacity;
+  }
+  return true;
+}
+
+/*
+ * Puts the preview of every head at its on-canvas size into a layer of the
+ * preview array, so that all of them can be drawn with one call. Heads keep
+ * their layers, and a layer is only redrawn when the texture contents, the
+ * on-canvas size or the filter change. Heads larger than ARRAY_LAYER_MAX on
+ * the canvas get no layer, since every layer is as large as the largest one.
+ * Returns false if the array can't be used, in which case the heads have to
+ * be drawn one by one.
+ */
+static bool update_array(struct wd_gl_data *res, struct wd_render_data *info,
+    struct saved_target *saved) {
+  struct wd_render_head_data **heads = res->heads;
+  bool *taken = res->taken_layers;
+  unsigned limit = MIN(ARRAY_LAYER_MAX, (unsigned) res->max_texture_size);
+  unsigned width = 1;
+  unsigned height = 1;
+  unsigned count = 0;
+
+  struct wd_render_head_data *head;
+  wl_list_for_each(head, &info->heads, link) {
+    struct wd_gl_texture *texture = head->texture;
+    if (texture->generation == 0 || display_width(head) > limit
+        || display_height(head) > limit) {
+      if (texture->layer >= 0)
+        res->quads_stale = true;
+      texture->layer = -1;
+      continue;
     }
+    width = MAX(width, display_width(head));
+    height = MAX(height, display_height(head));
+    taken[count] = false;
+    heads[count++] = head;
+  }
 
-    PUSH_POINT_UV(tri_ptr, x1, y1, sa, ta)
-    PUSH_POINT_UV(tri_ptr, x2, y1, sb, tb)
-    PUSH_POINT_UV(tri_ptr, x1, y2, sd, td)
-    PUSH_POINT_UV(tri_ptr, x1, y2, sd, td)
-    PUSH_POINT_UV(tri_ptr, x2, y1, sb, tb)
-    PUSH_POINT_UV(tri_ptr, x2, y2, sc, tc)
+  if (count == 0 || count > (unsigned) res->max_array_layers
+      || !alloc_array(res, width, height, count)) {
+    release_array(res);
+    for (unsigned i = 0; i < count; i++)
+      heads[i]->texture->layer = -1;
+    res->quads_stale = true;
+    return false;
+  }
 
-    tri_verts += 6;
-    i++;
-    if (i >= HEADS_MAX)
-      break;
+  for (unsigned i = 0; i < count; i++) {
+    struct wd_gl_texture *texture = heads[i]->texture;
+    if (texture->layer >= 0 && (unsigned) texture->layer < count
+        && !taken[texture->layer]) {
+      taken[texture->layer] = true;
+    } else {
+      texture->layer = -1;
+    }
   }
 
-  glClearColor(info->bg_color[0], info->bg_color[1], info->bg_color[2], 1.f);
-  glClear(GL_COLOR_BUFFER_BIT);
+  unsigned next = 0;
+  for (unsigned i = 0; i < count; i++) {
+    head = heads[i];
+    struct wd_gl_texture *texture = head->texture;
+    if (texture->layer < 0) {
+      while (taken[next])
+        next++;
+      taken[next] = true;
+      texture->layer = next;
+      texture->layer_serial = 0;
+    }
+    /* the shrunk copy for drawing the head on its own is not needed */
+    if (texture->scaled != 0) {
+      glDeleteTextures(1, &texture->scaled);
+      texture->scaled = 0;
+    }
 
-  float screen_size[2] = { info->viewport_width, info->viewport_height };
+    unsigned layer_width = display_width(head);
+    unsigned layer_height = display_height(head);
+    enum wd_preview_filter filter = layer_width == texture->width
+      && layer_height == texture->height
+      ? WD_PREVIEW_FILTER_BILINEAR : info->preview_filter;
+    /* the uv of a head depends on its layer and the layer's size */
+    bool placed = texture->layer_serial == res->array_serial
+      && texture->layer_width == layer_width
+      && texture->layer_height == layer_height;
+    if (!placed)
+      res->quads_stale = true;
+    if (placed && texture->layer_generation == texture->generation
+        && texture->layer_filter == filter)
+      continue;
+
+    if (!bind_target(res, saved, res->array, texture->layer))
+      return false;
+    draw_pass(res, filter, texture->texture, layer_width, layer_height);
+    texture->layer_width = layer_width;
+    texture->layer_height = layer_height;
+    texture->layer_generation = texture->generation;
+    texture->layer_filter = filter;
+    texture->layer_serial = res->array_serial;
+  }
+  return true;
+}
 
-  if (tri_verts > 0) {
-    glUseProgram(res->texture_program);
-    glBindBuffer(GL_ARRAY_BUFFER, res->buffers[TEXTURE_BUFFER]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0,
-        tri_verts * BT_UV_VERT_SIZE * sizeof(float), res->verts);
-    glEnableVertexAttribArray(res->texture_position_attribute);
-    glEnableVertexAttribArray(res->texture_uv_attribute);
-    glVertexAttribPointer(res->texture_position_attribute,
-        2, GL_FLOAT, GL_FALSE,
-        BT_UV_VERT_SIZE * sizeof(float), (void *) (0 * sizeof(float)));
-    glVertexAttribPointer(res->texture_uv_attribute, 2, GL_FLOAT, GL_FALSE,
-        BT_UV_VERT_SIZE * sizeof(float), (void *) (2 * sizeof(float)));
-    glUniform2fv(res->texture_screen_size_uniform, 1, screen_size);
-    glUniform1i(res->texture_texture_uniform, 0);
-    glActiveTexture(GL_TEXTURE0);
-
-    i = 0;
-    wl_list_for_each_reverse(head, &info->heads, link) {
-      glBindTexture(GL_TEXTURE_2D, res->textures[i]);
-      if (head->updated_at == tick) {
-        glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, head->tex_stride / 4);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-            head->tex_width, head->tex_height,
-            0, GL_RGBA, GL_UNSIGNED_BYTE, head->pixels);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
-        glGenerateMipmap(GL_TEXTURE_2D);
-      }
-      glUniformMatrix4fv(res->texture_color_transform_uniform, 1, GL_FALSE,
-        head->swap_rgb ? TRANSFORM_RGB : TRANSFORM_BGR);
-      glDrawArrays(GL_TRIANGLES, i * 6, 6);
-      i++;
-      if (i >= HEADS_MAX)
-        break;
+/*
+ * Writes the vertices in res->verts that differ from what the buffer already
+ * holds, one range per run of changed groups of group_size floats, and leaves
+ * the buffer bound. Nothing is sent if the vertices didn't change. The buffer
+ * grows as needed. Returns false if it couldn't be grown.
+ */
+static bool upload_verts(struct wd_gl_data *res, enum gl_buffers buffer,
+    size_t size, size_t group_size) {
+  glBindBuffer(GL_ARRAY_BUFFER, res->buffers[buffer]);
+  if (size > res->buffer_capacities[buffer]) {
+    size_t capacity = grow_capacity(res->buffer_capacities[buffer], size);
+    float *verts = realloc(res->buffer_verts[buffer],
+        capacity * sizeof(float));
+    if (verts == NULL) {
+      fprintf(stderr, "failed to allocate vertex buffer copy\n");
+      return false;
+    }
+    res->buffer_verts[buffer] = verts;
+    res->buffer_capacities[buffer] = capacity;
+    glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(float),
+        NULL, GL_DYNAMIC_DRAW);
+    /* the new storage holds nothing yet */
+    res->buffer_sizes[buffer] = 0;
+  }
+
+  float *retained = res->buffer_verts[buffer];
+  size_t old_size = res->buffer_sizes[buffer];
+  size_t run_start = 0;
+  bool in_run = false;
+  for (size_t start = 0; start < size + group_size; start += group_size) {
+    size_t end = MIN(start + group_size, size);
+    bool changed = start < size && (end > old_size
+        || memcmp(retained + start, res->verts + start,
+          (end - start) * sizeof(float)) != 0);
+    if (changed && !in_run) {
+      run_start = start;
+      in_run = true;
+    } else if (!changed && in_run) {
+      size_t run_size = MIN(start, size) - run_start;
+      glBufferSubData(GL_ARRAY_BUFFER, run_start * sizeof(float),
+          run_size * sizeof(float), res->verts + run_start);
+      memcpy(retained + run_start, res->verts + run_start,
+          run_size * sizeof(float));
+      in_run = false;
     }
   }
+  res->buffer_sizes[buffer] = size;
+  return true;
+}
 
-  tri_verts = 0;
+/*
+ * Sends the vertices just built in res->verts, or if they weren't rebuilt
+ * keeps what the buffer holds without comparing anything. Leaves the buffer
+ * bound and returns the number of floats it holds.
+ */
+static size_t sync_verts(struct wd_gl_data *res, enum gl_buffers buffer,
+    bool rebuilt, size_t size, size_t group_size) {
+  if (!rebuilt) {
+    glBindBuffer(GL_ARRAY_BUFFER, res->buffers[buffer]);
+    return res->buffer_sizes[buffer];
+  }
+  if (!upload_verts(res, buffer, size, group_size)) {
+    /* build everything again next time */
+    res->buffer_sizes[buffer] = 0;
+    res->quads_stale = true;
+    return 0;
+  }
+  return size;
+}
 
+/*
+ * Builds the highlight of each hovered head in res->verts, fading in and out
+ * over HOVER_USECS. Returns the number of vertices.
+ */
+static unsigned push_hover_quads(struct wd_gl_data *res,
+    struct wd_render_data *info, uint64_t tick) {
+  unsigned tri_verts = 0;
   int j = 0;
-  i = 0;
-  bool any_clicked = false;
-  uint64_t click_begin = 0;
+  struct wd_render_head_data *head;
   wl_list_for_each_reverse(head, &info->heads, link) {
-    any_clicked = head->clicked || any_clicked;
-    if (head->click_begin > click_begin)
-      click_begin = head->click_begin;
     if (head->hovered || tick < head->hover_begin + HOVER_USECS) {
       float *tri_ptr = res->verts + j++ * BT_COLOR_QUAD_SIZE;
       float x1 = head->x1;
@@ -388,31 +934,27 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
 
       tri_verts += 6;
     }
-    i++;
-    if (i >= HEADS_MAX)
-      break;
   }
+  return tri_verts;
+}
 
-  if (tri_verts > 0) {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glUseProgram(res->color_program);
-    glBindBuffer(GL_ARRAY_BUFFER, res->buffers[COLOR_BUFFER]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0,
-        tri_verts * BT_COLOR_VERT_SIZE * sizeof(float), res->verts);
-    glEnableVertexAttribArray(res->color_position_attribute);
-    glEnableVertexAttribArray(res->color_color_attribute);
-    glVertexAttribPointer(res->color_position_attribute, 2, GL_FLOAT, GL_FALSE,
-        BT_COLOR_VERT_SIZE * sizeof(float), (void *) (0 * sizeof(float)));
-    glVertexAttribPointer(res->color_color_attribute, 4, GL_FLOAT, GL_FALSE,
-        BT_COLOR_VERT_SIZE * sizeof(float), (void *) (2 * sizeof(float)));
-    glUniform2fv(res->color_screen_size_uniform, 1, screen_size);
-    glDrawArrays(GL_TRIANGLES, 0, tri_verts);
-    glDisable(GL_BLEND);
+/*
+ * Builds the outline of each head in res->verts, and while a head is clicked
+ * the guides along its edges, fading in and out over HOVER_USECS. Returns the
+ * number of vertices.
+ */
+static unsigned push_lines(struct wd_gl_data *res,
+    struct wd_render_data *info, uint64_t tick, const float screen_size[2]) {
+  bool any_clicked = false;
+  uint64_t click_begin = 0;
+  struct wd_render_head_data *head;
+  wl_list_for_each(head, &info->heads, link) {
+    any_clicked = head->clicked || any_clicked;
+    if (head->click_begin > click_begin)
+      click_begin = head->click_begin;
   }
 
   unsigned int line_verts = 0;
-  i = 0;
   float *line_ptr = res->verts;
   if (any_clicked || (click_begin && tick < click_begin + HOVER_USECS)) {
     const float ox = -info->scroll_x - info->x_origin;
@@ -488,18 +1030,254 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
       line_verts += 16;
     }
 
-    i++;
-    if (i >= HEADS_MAX)
-      break;
   }
+  return line_verts;
+}
+
+/*
+ * Draws count quads of the texture buffer from the preview array, starting
+ * at quad first.
+ */
+static void draw_array_quads(struct wd_gl_data *res,
+    const float screen_size[2], unsigned first, unsigned count) {
+  glUseProgram(res->array_program);
+  glEnableVertexAttribArray(res->array_position_attribute);
+  glEnableVertexAttribArray(res->array_uv_attribute);
+  glEnableVertexAttribArray(res->array_layer_attribute);
+  glEnableVertexAttribArray(res->array_swap_attribute);
+  glEnableVertexAttribArray(res->array_limit_attribute);
+  glVertexAttribPointer(res->array_position_attribute, 2, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (0 * sizeof(float)));
+  glVertexAttribPointer(res->array_uv_attribute, 2, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (2 * sizeof(float)));
+  glVertexAttribPointer(res->array_layer_attribute, 1, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (4 * sizeof(float)));
+  glVertexAttribPointer(res->array_swap_attribute, 1, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (5 * sizeof(float)));
+  glVertexAttribPointer(res->array_limit_attribute, 2, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (6 * sizeof(float)));
+  glUniform2fv(res->array_screen_size_uniform, 1, screen_size);
+  glUniform1i(res->array_texture_uniform, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, res->array);
+
+  glDrawArrays(GL_TRIANGLES, first * 6, count * 6);
+
+  glDisableVertexAttribArray(res->array_layer_attribute);
+  glDisableVertexAttribArray(res->array_swap_attribute);
+  glDisableVertexAttribArray(res->array_limit_attribute);
+}
+
+/*
+ * Draws count quads of the texture buffer, each from its own texture in
+ * textures, starting at quad first.
+ */
+static void draw_texture_quads(struct wd_gl_data *res,
+    const float screen_size[2], const GLuint *textures,
+    unsigned first, unsigned count) {
+  glUseProgram(res->texture_program);
+  glEnableVertexAttribArray(res->texture_position_attribute);
+  glEnableVertexAttribArray(res->texture_uv_attribute);
+  glEnableVertexAttribArray(res->texture_swap_attribute);
+  glVertexAttribPointer(res->texture_position_attribute,
+      2, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (0 * sizeof(float)));
+  glVertexAttribPointer(res->texture_uv_attribute, 2, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (2 * sizeof(float)));
+  glVertexAttribPointer(res->texture_swap_attribute, 1, GL_FLOAT, GL_FALSE,
+      BT_UV_VERT_SIZE * sizeof(float), (void *) (5 * sizeof(float)));
+  glUniform2fv(res->texture_screen_size_uniform, 1, screen_size);
+  glUniform1i(res->texture_texture_uniform, 0);
+  glActiveTexture(GL_TEXTURE0);
+
+  /* only the texture changes between heads */
+  for (unsigned q = first; q < first + count; q++) {
+    glBindTexture(GL_TEXTURE_2D, textures[q]);
+    glDrawArrays(GL_TRIANGLES, q * 6, 6);
+  }
+
+  glDisableVertexAttribArray(res->texture_swap_attribute);
+}
+
+void wd_gl_release_head(struct wd_render_data *info,
+    struct wd_render_head_data *head) {
+  info->verts_dirty = true;
+  if (head->texture != NULL) {
+    wl_list_insert(&info->released_textures, &head->texture->link);
+    head->texture = NULL;
+  }
+}
 
+void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
+    uint64_t tick) {
+  unsigned int tri_verts = 0;
+
+  struct wd_gl_texture *texture, *texture_tmp;
+  wl_list_for_each_safe(texture, texture_tmp, &info->released_textures, link) {
+    destroy_texture(texture);
+  }
+
+  unsigned head_count = wl_list_length(&info->heads);
+  /* the guide lines are the largest of the vertex sets */
+  if (!reserve_scratch(res, BT_LINE_EXT_SIZE * (head_count + 1), head_count)) {
+    fprintf(stderr, "failed to allocate render data for %u heads\n",
+        head_count);
+    return;
+  }
+
+  struct wd_render_head_data *head;
+  wl_list_for_each_reverse(head, &info->heads, link) {
+    update_texture(res, head);
+  }
+
+  struct saved_target saved = { 0 };
+  bool batched = res->array_program != 0
+    && update_array(res, info, &saved);
+  if (batched != res->batched)
+    res->quads_stale = true;
+  res->batched = batched;
+
+  /* the vertices only change with the layout, hovering, clicking and the
+   * placement of the textures, or while an animation runs */
+  bool rebuild = info->verts_dirty || res->quads_stale;
+  res->quads_stale = false;
+  bool hover_animating = false;
+  bool click_animating = false;
+  wl_list_for_each(head, &info->heads, link) {
+    hover_animating = hover_animating || tick < head->hover_begin + HOVER_USECS;
+    click_animating = click_animating
+      || (head->click_begin && tick < head->click_begin + HOVER_USECS);
+  }
+
+  GLuint *textures = res->textures;
+  wl_list_for_each_reverse(head, &info->heads, link) {
+    struct wd_gl_texture *texture = head->texture;
+    if (texture->generation == 0)
+      continue;
+
+    if (batched && texture->layer >= 0)
+      textures[tri_verts / 6] = 0;
+    else
+      textures[tri_verts / 6] = downsample_texture(res, info, head, &saved);
+    if (!rebuild) {
+      tri_verts += 6;
+      continue;
+    }
+
+    float *tri_ptr = res->verts + tri_verts * BT_UV_VERT_SIZE;
+    /* the texture may only cover the part of the head that was captured */
+    float rx1 = lerp(head->x1, head->x2, head->tex_region.x1);
+    float ry1 = lerp(head->y1, head->y2, head->tex_region.y1);
+    float rx2 = lerp(head->x1, head->x2, head->tex_region.x2);
+    float ry2 = lerp(head->y1, head->y2, head->tex_region.y2);
+    float x1 = head->active.x_invert ? rx2 : rx1;
+    float y1 = head->y_invert ? ry2 : ry1;
+    float x2 = head->active.x_invert ? rx1 : rx2;
+    float y2 = head->y_invert ? ry1 : ry2;
+
+    /* layer, swizzle and the largest uv that stays inside the layer */
+    float extra[4] = { 0.f, head->swap_rgb ? 0.f : 1.f, 1.f, 1.f };
+    float s_max = 1.f;
+    float t_max = 1.f;
+    if (batched && texture->layer >= 0) {
+      s_max = texture->layer_width / (float) res->array_width;
+      t_max = texture->layer_height / (float) res->array_height;
+      extra[0] = texture->layer;
+      extra[2] = (texture->layer_width - .5f) / res->array_width;
+      extra[3] = (texture->layer_height - .5f) / res->array_height;
+    }
+
+    float sa = 0.f;
+    float sb = s_max;
+    float sc = sb;
+    float sd = sa;
+    float ta = 0.f;
+    float tb = ta;
+    float tc = t_max;
+    float td = tc;
+    for (int i = 0; i < head->active.rotation; i++) {
+      float tmp = sd;
+      sd = sc;
+      sc = sb;
+      sb = sa;
+      sa = tmp;
+
+      tmp = td;
+      td = tc;
+      tc = tb;
+      tb = ta;
+      ta = tmp;
+    }
+
+    PUSH_POINT_UV(tri_ptr, x1, y1, sa, ta, extra)
+    PUSH_POINT_UV(tri_ptr, x2, y1, sb, tb, extra)
+    PUSH_POINT_UV(tri_ptr, x1, y2, sd, td, extra)
+    PUSH_POINT_UV(tri_ptr, x1, y2, sd, td, extra)
+    PUSH_POINT_UV(tri_ptr, x2, y1, sb, tb, extra)
+    PUSH_POINT_UV(tri_ptr, x2, y2, sc, tc, extra)
+
+    tri_verts += 6;
+  }
+  if (saved.saved) {
+    glBindFramebuffer(GL_FRAMEBUFFER, saved.framebuffer);
+    glViewport(saved.viewport[0], saved.viewport[1],
+        saved.viewport[2], saved.viewport[3]);
+  }
+
+  glClearColor(info->bg_color[0], info->bg_color[1], info->bg_color[2], 1.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  float screen_size[2] = { info->viewport_width, info->viewport_height };
+
+  tri_verts = sync_verts(res, TEXTURE_BUFFER, rebuild,
+      tri_verts * BT_UV_VERT_SIZE, BT_UV_QUAD_SIZE) / BT_UV_VERT_SIZE;
+  /* quads without a texture of their own are drawn from the array, as
+   * few calls as the draw order allows */
+  unsigned quads = tri_verts / 6;
+  for (unsigned q = 0; q < quads;) {
+    bool array = textures[q] == 0;
+    unsigned end = q + 1;
+    while (end < quads && (textures[end] == 0) == array)
+      end++;
+    if (array)
+      draw_array_quads(res, screen_size, q, end - q);
+    else
+      draw_texture_quads(res, screen_size, textures, q, end - q);
+    q = end;
+  }
+
+  bool hover_rebuild = rebuild || hover_animating || res->hover_animating;
+  res->hover_animating = hover_animating;
+  tri_verts = hover_rebuild ? push_hover_quads(res, info, tick) : 0;
+  tri_verts = sync_verts(res, COLOR_BUFFER, hover_rebuild,
+      tri_verts * BT_COLOR_VERT_SIZE, BT_COLOR_QUAD_SIZE) / BT_COLOR_VERT_SIZE;
+  if (tri_verts > 0) {
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(res->color_program);
+    glEnableVertexAttribArray(res->color_position_attribute);
+    glEnableVertexAttribArray(res->color_color_attribute);
+    glVertexAttribPointer(res->color_position_attribute, 2, GL_FLOAT, GL_FALSE,
+        BT_COLOR_VERT_SIZE * sizeof(float), (void *) (0 * sizeof(float)));
+    glVertexAttribPointer(res->color_color_attribute, 4, GL_FLOAT, GL_FALSE,
+        BT_COLOR_VERT_SIZE * sizeof(float), (void *) (2 * sizeof(float)));
+    glUniform2fv(res->color_screen_size_uniform, 1, screen_size);
+    glDrawArrays(GL_TRIANGLES, 0, tri_verts);
+    glDisable(GL_BLEND);
+  }
+
+  bool lines_rebuild = rebuild || click_animating || res->click_animating;
+  res->click_animating = click_animating;
+  unsigned line_verts = lines_rebuild
+    ? push_lines(res, info, tick, screen_size) : 0;
+  /* the lines come in groups of four vertices */
+  line_verts = sync_verts(res, LINE_BUFFER, lines_rebuild,
+      line_verts * BT_LINE_VERT_SIZE, 4 * BT_LINE_VERT_SIZE)
+    / BT_LINE_VERT_SIZE;
   if (line_verts > 0) {
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glUseProgram(res->color_program);
-    glBindBuffer(GL_ARRAY_BUFFER, res->buffers[LINE_BUFFER]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0,
-        line_verts * BT_LINE_VERT_SIZE * sizeof(float), res->verts);
     glEnableVertexAttribArray(res->color_position_attribute);
     glEnableVertexAttribArray(res->color_color_attribute);
     glVertexAttribPointer(res->color_position_attribute, 2, GL_FLOAT, GL_FALSE,
@@ -510,10 +1288,39 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
     glDrawArrays(GL_LINES, 0, line_verts);
     glDisable(GL_BLEND);
   }
+
+  info->verts_dirty = false;
 }
 
-void wd_gl_cleanup(struct wd_gl_data *res) {
+void wd_gl_cleanup(struct wd_gl_data *res, struct wd_render_data *info) {
+  struct wd_render_head_data *head;
+  wl_list_for_each(head, &info->heads, link) {
+    wd_gl_release_head(info, head);
+  }
+  struct wd_gl_texture *texture, *texture_tmp;
+  wl_list_for_each_safe(texture, texture_tmp, &info->released_textures, link) {
+    destroy_texture(texture);
+  }
   glDeleteBuffers(NUM_BUFFERS, res->buffers);
+  for (int b = 0; b < NUM_BUFFERS; b++) {
+    free(res->buffer_verts[b]);
+  }
+  free(res->verts);
+  free(res->heads);
+  free(res->taken_layers);
+  free(res->textures);
+  if (res->framebuffer != 0)
+    glDeleteFramebuffers(1, &res->framebuffer);
+  for (int f = 0; f < WD_PREVIEW_FILTER_COUNT; f++) {
+    glDeleteShader(res->downsample_fragment_shaders[f]);
+    glDeleteProgram(res->downsample_programs[f]);
+  }
+  glDeleteShader(res->downsample_vertex_shader);
+  if (res->array != 0)
+    glDeleteTextures(1, &res->array);
+  glDeleteShader(res->array_fragment_shader);
+  glDeleteShader(res->array_vertex_shader);
+  glDeleteProgram(res->array_program);
   glDeleteShader(res->texture_fragment_shader);
   glDeleteShader(res->texture_vertex_shader);
   glDeleteProgram(res->texture_program);
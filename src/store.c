@@ -170,50 +170,11 @@ struct profile_line match(char **descriptions, int num, const char *filename) {
   return matched_profile;
 }
 
-int wd_store_config(struct wl_list *outputs) {
-  const char *file_name = wd_get_kanshi_config();
+// writes the output configs to the profile matching descriptions, or a new one
+static int write_profile(const char *file_name, char **descriptions, char **outputConfigs, int num_of_monitors) {
   char tmp_file_name[PATH_MAX];
   sprintf(tmp_file_name, "%s.tmp", file_name);
 
-  char *descriptions[HEADS_MAX];
-  for (int i = 0; i < HEADS_MAX; i++) descriptions[i] = NULL;
-
-  char *outputConfigs[HEADS_MAX];
-  for (int i = 0; i < HEADS_MAX; i++) outputConfigs[i] = (char *)malloc(MAX_NAME_LENGTH);
-
-  struct wd_head_config *output;
-  int description_index = 0;
-  wl_list_for_each(output, outputs, link) {
-    struct wd_head *head = output->head;
-
-    // for transform
-    char *trans_str;
-    switch (output->transform) {
-      case WL_OUTPUT_TRANSFORM_NORMAL     : trans_str = "normal";
-      case WL_OUTPUT_TRANSFORM_90         : trans_str = "90";
-      case WL_OUTPUT_TRANSFORM_180        : trans_str = "180";
-      case WL_OUTPUT_TRANSFORM_270        : trans_str = "270";
-      case WL_OUTPUT_TRANSFORM_FLIPPED_90 : trans_str = "flipped-90";
-      case WL_OUTPUT_TRANSFORM_FLIPPED_180: trans_str = "flipped-180";
-      case WL_OUTPUT_TRANSFORM_FLIPPED_270: trans_str = "flipped-270";
-      default                             : trans_str = "normal";
-    };
-
-    if (description_index < HEADS_MAX) {
-      descriptions[description_index] = strdup(head->description);
-      // write output config in given format
-      sprintf(outputConfigs[description_index], "output \"%s\" position %d,%d mode %dx%d@%.4f scale %.2f transform %s",
-              head->description, output->x, output->y, output->width, output->height, output->refresh / 1.0e3, output->scale,
-              trans_str);
-      description_index++;
-    } else {
-      dprintf(2, "Too many monitor!\n\t%i is the maximum allowed number", HEADS_MAX);
-      return 1;
-    }
-  }
-
-  int num_of_monitors = description_index;
-
   struct profile_line matched_profile;
   matched_profile = match(descriptions, num_of_monitors, file_name);
 
@@ -228,7 +189,6 @@ int wd_store_config(struct wl_list *outputs) {
     fprintf(file, "\nprofile {\n");
     for (int i = 0; i < num_of_monitors; i++) {
       fprintf(file, "    %s\n", outputConfigs[i]);
-      free(outputConfigs[i]);
     }
     fprintf(file, "}");
     fclose(file);
@@ -258,7 +218,6 @@ int wd_store_config(struct wl_list *outputs) {
           return 1;
         }
         fprintf(tmp, "    %s\n", outputConfigs[_i_output]);
-        free(outputConfigs[_i_output]);
 
         _i_output++;
       } else {
@@ -275,3 +234,60 @@ int wd_store_config(struct wl_list *outputs) {
 
   return 0;
 }
+
+int wd_store_config(struct wl_list *outputs) {
+  char *file_name = wd_get_config_file_path();
+  if (file_name == NULL) return 1;
+
+  // sized for the outputs, descriptions is NULL terminated for match()
+  int num_of_outputs    = wl_list_length(outputs);
+  char **descriptions   = calloc(num_of_outputs + 1, sizeof(char *));
+  char **outputConfigs  = calloc(num_of_outputs, sizeof(char *));
+  if (descriptions == NULL || outputConfigs == NULL) {
+    dprintf(2, "%s:%i:%s(): Cannot allocate %i output configs\n", __FILE__, __LINE__, __func__, num_of_outputs);
+    free(descriptions);
+    free(outputConfigs);
+    free(file_name);
+    return 1;
+  }
+  for (int i = 0; i < num_of_outputs; i++) outputConfigs[i] = (char *)malloc(MAX_NAME_LENGTH);
+
+  struct wd_head_config *output;
+  int description_index = 0;
+  wl_list_for_each(output, outputs, link) {
+    struct wd_head *head = output->head;
+
+    // for transform
+    char *trans_str;
+    switch (output->transform) {
+      case WL_OUTPUT_TRANSFORM_NORMAL     : trans_str = "normal";
+      case WL_OUTPUT_TRANSFORM_90         : trans_str = "90";
+      case WL_OUTPUT_TRANSFORM_180        : trans_str = "180";
+      case WL_OUTPUT_TRANSFORM_270        : trans_str = "270";
+      case WL_OUTPUT_TRANSFORM_FLIPPED_90 : trans_str = "flipped-90";
+      case WL_OUTPUT_TRANSFORM_FLIPPED_180: trans_str = "flipped-180";
+      case WL_OUTPUT_TRANSFORM_FLIPPED_270: trans_str = "flipped-270";
+      default                             : trans_str = "normal";
+    };
+
+    descriptions[description_index] = strdup(head->description);
+    // write output config in given format
+    sprintf(outputConfigs[description_index], "output \"%s\" position %d,%d mode %dx%d@%.4f scale %.2f transform %s",
+            head->description, output->x, output->y, output->width, output->height, output->refresh / 1.0e3, output->scale,
+            trans_str);
+    description_index++;
+  }
+
+  int num_of_monitors = description_index;
+
+  int result = write_profile(file_name, descriptions, outputConfigs, num_of_monitors);
+
+  for (int i = 0; i < num_of_outputs; i++) {
+    free(descriptions[i]);
+    free(outputConfigs[i]);
+  }
+  free(descriptions);
+  free(outputConfigs);
+  free(file_name);
+  return result;
+}
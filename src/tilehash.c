@@ -0,0 +1,119 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "tilehash.h"
+
+#include <string.h>
+
+#define HASH_PRIME1 0x9E3779B1u
+#define HASH_PRIME2 0x85EBCA77u
+
+static inline uint32_t rotl32(uint32_t x, unsigned r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t hash_round(uint32_t acc, uint32_t input) {
+  return rotl32(acc + input * HASH_PRIME2, 13) * HASH_PRIME1;
+}
+
+static void hash_row_scalar(uint32_t lanes[4], const uint8_t *row,
+    size_t groups) {
+  for (size_t i = 0; i < groups; i++, row += 16) {
+    for (int l = 0; l < 4; l++) {
+      uint32_t pixel;
+      memcpy(&pixel, row + l * 4, sizeof(pixel));
+      lanes[l] = hash_round(lanes[l], pixel);
+    }
+  }
+}
+
+static const struct wd_hash_kernel kernel_scalar = {
+  "scalar", hash_row_scalar
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+      _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void hash_row_sse2(uint32_t lanes[4], const uint8_t *row,
+    size_t groups) {
+  const __m128i prime1 = _mm_set1_epi32(HASH_PRIME1);
+  const __m128i prime2 = _mm_set1_epi32(HASH_PRIME2);
+  __m128i acc = _mm_loadu_si128((const __m128i *) lanes);
+  for (size_t i = 0; i < groups; i++, row += 16) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *) row);
+    acc = _mm_add_epi32(acc, mullo_epi32_sse2(pixels, prime2));
+    acc = _mm_or_si128(_mm_slli_epi32(acc, 13), _mm_srli_epi32(acc, 19));
+    acc = mullo_epi32_sse2(acc, prime1);
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+}
+
+static const struct wd_hash_kernel kernel_sse2 = {
+  "sse2", hash_row_sse2
+};
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static void hash_row_neon(uint32_t lanes[4], const uint8_t *row,
+    size_t groups) {
+  const uint32x4_t prime1 = vdupq_n_u32(HASH_PRIME1);
+  const uint32x4_t prime2 = vdupq_n_u32(HASH_PRIME2);
+  uint32x4_t acc = vld1q_u32(lanes);
+  for (size_t i = 0; i < groups; i++, row += 16) {
+    uint32x4_t pixels = vreinterpretq_u32_u8(vld1q_u8(row));
+    acc = vmlaq_u32(acc, pixels, prime2);
+    acc = vsriq_n_u32(vshlq_n_u32(acc, 13), acc, 19);
+    acc = vmulq_u32(acc, prime1);
+  }
+  vst1q_u32(lanes, acc);
+}
+
+static const struct wd_hash_kernel kernel_neon = {
+  "neon", hash_row_neon
+};
+#endif
+
+static const struct wd_hash_kernel *kernels[3];
+static size_t kernel_count;
+
+const struct wd_hash_kernel *const *wd_hash_kernels(size_t *count) {
+  if (kernel_count == 0) {
+    kernels[kernel_count++] = &kernel_scalar;
+#if defined(__SSE2__)
+    kernels[kernel_count++] = &kernel_sse2;
+#endif
+#if defined(__ARM_NEON)
+    kernels[kernel_count++] = &kernel_neon;
+#endif
+  }
+  *count = kernel_count;
+  return kernels;
+}
+
+uint64_t wd_hash_region(const struct wd_hash_kernel *kernel,
+    const uint8_t *src, unsigned stride, unsigned width, unsigned height) {
+  uint32_t lanes[4] = {
+    HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1
+  };
+  size_t groups = width / 4;
+  for (unsigned y = 0; y < height; y++) {
+    const uint8_t *row = src + (size_t) y * stride;
+    kernel->hash_row(lanes, row, groups);
+    for (unsigned x = groups * 4; x < width; x++) {
+      uint32_t pixel;
+      memcpy(&pixel, row + x * 4, sizeof(pixel));
+      lanes[x & 3] = hash_round(lanes[x & 3], pixel);
+    }
+  }
+  return (uint64_t) (rotl32(lanes[0], 1) + rotl32(lanes[1], 7)) << 32
+    | (rotl32(lanes[2], 12) + rotl32(lanes[3], 18));
+}
@@ -0,0 +1,35 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#ifndef WDISPLAY_TILEHASH_H
+#define WDISPLAY_TILEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One implementation of the row hashing behind wd_hash_tile. All of them give
+ * the same result.
+ */
+struct wd_hash_kernel {
+  const char *name;
+  /*
+   * Feeds groups of four pixels of a row into four independent hash lanes,
+   * one pixel per lane.
+   */
+  void (*hash_row)(uint32_t lanes[4], const uint8_t *row, size_t groups);
+};
+
+/*
+ * Returns the kernels this CPU can run, the portable one first and the
+ * fastest one last.
+ */
+const struct wd_hash_kernel *const *wd_hash_kernels(size_t *count);
+
+/*
+ * Hashes width by height 32-bit pixels with the given kernel.
+ */
+uint64_t wd_hash_region(const struct wd_hash_kernel *kernel,
+    const uint8_t *src, unsigned stride, unsigned width, unsigned height);
+
+#endif
@@ -14,9 +14,11 @@
 
 #include "config.h"
 
-#define HEADS_MAX   64
-#define HOVER_USECS (100 * 1000)
+#define HOVER_USECS     (100 * 1000)
+#define CAPTURE_BUFFERS 4
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <wayland-client.h>
 
@@ -41,6 +43,31 @@ typedef struct _GdkCursor GdkCursor;
 struct _cairo_surface;
 typedef struct _cairo_surface cairo_surface_t;
 
+/*
+ * A box in the 0-1 range relative to the extents of a head.
+ */
+struct wd_fbox {
+  float x1;
+  float y1;
+  float x2;
+  float y2;
+};
+
+static inline bool wd_fbox_equal(const struct wd_fbox *a,
+    const struct wd_fbox *b) {
+  return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+struct wd_rect {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+struct wd_frame;
+struct wd_gl_texture;
+
 struct wd_output {
   struct wd_state *state;
   struct zxdg_output_v1 *xdg_output;
@@ -48,24 +75,71 @@ struct wd_output {
   struct wl_list link;
 
   char *name;
-  struct wl_list frames;
+  struct wd_head *head; /* the head with the same name, if any */
+
+  /* capture state, guarded by the capture lock of wd_state */
+  struct wl_list frames; /* captures in flight */
+  struct wl_list buffers;
+  struct wd_fbox capture_region; /* of the last requested capture */
+  unsigned capture_failures; /* consecutive failed or timed out captures */
+  uint64_t capture_retry_at; /* usecs, CLOCK_MONOTONIC */
+  struct wd_fbox capture_target; /* where to capture next */
+  struct wd_rect capture_logical; /* same in logical coordinates, if partial */
+  bool capture_visible;
+  /* per-tile hashes of the last capture that came without damage, taken from
+   * a frame of tile_width x tile_height, or none if tile_width is 0 */
+  uint64_t *tile_hashes;
+  unsigned tile_width;
+  unsigned tile_height;
+  struct wd_fbox tile_region;
+
+  /* the latest ready capture, handed over from the capture thread */
+  _Atomic(struct wd_frame *) capture_slot;
+  /* the capture currently shown, owned by the main thread */
+  struct wd_frame *frame;
+
   GtkWidget *overlay_window;
   struct zwlr_layer_surface_v1 *overlay_layer_surface;
 };
 
+/*
+ * A shared memory buffer that screencopy frames are copied into. Buffers are
+ * kept per output and reused across frames until the compositor asks for a
+ * different format or size.
+ */
+struct wd_buffer {
+  struct wd_output *output;
+  struct wl_list link;
+
+  int fd;
+  size_t size;
+  struct wl_shm_pool *pool;
+  struct wl_buffer *wl_buffer;
+  uint8_t *pixels;
+  uint32_t format;
+  unsigned stride;
+  unsigned width;
+  unsigned height;
+  atomic_bool busy;
+};
+
 struct wd_frame {
   struct wd_output *output;
   struct zwlr_screencopy_frame_v1 *wlr_frame;
 
   struct wl_list link;
-  int capture_fd;
+  struct wd_buffer *buffer;
   unsigned stride;
   unsigned width;
   unsigned height;
-  struct wl_shm_pool *pool;
-  struct wl_buffer *buffer;
   uint8_t *pixels;
   uint64_t tick;
+  uint64_t requested_at; /* usecs, CLOCK_MONOTONIC */
+  struct wd_fbox region;
+  struct wl_array damage; /* struct wd_rect, in buffer coordinates */
+  bool track_damage;
+  bool full_damage;
+  bool consumed;
   bool y_invert;
   bool swap_rgb;
 };
@@ -92,6 +166,41 @@ struct wd_mode {
   int32_t width, height;
   int32_t refresh; // mHz
   bool preferred;
+  /* configuration tested for this mode, see wd_test_mode_result() */
+  uint64_t test_hash;
+};
+
+/*
+ * Result of testing a configuration with the compositor.
+ */
+enum wd_test_result {
+  WD_TEST_UNKNOWN,
+  WD_TEST_PENDING,
+  WD_TEST_PASSED,
+  WD_TEST_FAILED,
+};
+
+/*
+ * The configuration of a head as entered in its form. The form copies its
+ * fields here whenever they change, so that the canvas and the change
+ * tracking never have to read widgets.
+ */
+struct wd_head_layout {
+  bool enabled;
+  double x;
+  double y;
+  double width;
+  double height;
+  double refresh; /* Hz */
+  double scale;
+  int rotation_id; /* quarter turns */
+  bool flipped;
+
+  /* wd_head_fields changed since `changed' was last worked out */
+  unsigned dirty;
+  /* wd_head_fields in which the layout differs from the current state of
+   * the head */
+  unsigned changed;
 };
 
 struct wd_head {
@@ -102,11 +211,26 @@ struct wd_head {
   struct wd_output *output;
   struct wd_render_head_data *render;
   cairo_surface_t *surface;
+  GtkWidget *form;
+  struct wd_head_layout layout;
+  /* fields changed by the compositor since the last
+   * zwlr_output_manager_v1.done, applied to the form all at once */
+  enum wd_head_fields pending_fields;
 
   uint32_t id;
   char *name, *description;
   int32_t phys_width, phys_height; // mm
   struct wl_list modes;
+  /* pointers to the modes sorted by size and refresh rate without
+   * duplicates, rebuilt on done if modes_changed */
+  struct wl_array sorted_modes;
+  struct wd_mode *preferred_mode;
+  unsigned modes_generation;
+  bool modes_changed;
+  /* bumped when a mode starts or stops failing its test */
+  unsigned failed_modes_generation;
+  /* failed_modes_generation changed since the mode menu was last updated */
+  bool tests_changed;
 
   bool enabled;
   struct wd_mode *mode;
@@ -123,6 +247,15 @@ struct wd_head {
 
 struct wd_gl_data;
 
+/*
+ * How preview textures are shrunk to their on-canvas size.
+ */
+enum wd_preview_filter {
+  WD_PREVIEW_FILTER_BILINEAR,
+  WD_PREVIEW_FILTER_4TAP,
+  WD_PREVIEW_FILTER_COUNT
+};
+
 struct wd_render_head_flags {
   uint8_t rotation;
   bool x_invert;
@@ -130,7 +263,6 @@ struct wd_render_head_flags {
 
 struct wd_render_head_data {
   struct wl_list link;
-  uint64_t updated_at;
   uint64_t hover_begin;
   uint64_t click_begin;
 
@@ -143,10 +275,34 @@ struct wd_render_head_data {
   struct wd_render_head_flags active;
 
   uint8_t *pixels;
+  /* bumped whenever pixels change, damage is relative to the previous one */
+  uint64_t generation;
   unsigned tex_stride;
   unsigned tex_width;
   unsigned tex_height;
 
+  /* regions of pixels that changed since the last upload */
+  const struct wd_rect *damage;
+  size_t damage_count;
+  bool full_damage;
+
+  /* part of the head covered by the texture */
+  struct wd_fbox tex_region;
+  /* on-canvas size of the texture in device pixels */
+  unsigned target_width;
+  unsigned target_height;
+
+  /* captured frame shrunk by 2^tex_shift to roughly the on-canvas size */
+  unsigned tex_shift;
+  uint8_t *scaled;
+  size_t scaled_size;
+  struct wl_array scaled_damage;
+
+  /* owned by the renderer, follows the head when heads are reordered */
+  struct wd_gl_texture *texture;
+  /* style_generation the label was drawn with, when not previewing */
+  uint64_t style_generation;
+
   bool preview;
   bool y_invert;
   bool swap_rgb;
@@ -168,8 +324,19 @@ struct wd_render_data {
   int x_origin;
   int y_origin;
   uint64_t updated_at;
+  enum wd_preview_filter preview_filter;
+  /* the colors above are looked up again when this is unset */
+  bool style_valid;
+  /* bumped when the theme changes, so that head labels are drawn again */
+  uint64_t style_generation;
+  /* set when anything the canvas vertices are built from changes, like the
+   * position of a head, hovering, clicking, scrolling or the theme; cleared by
+   * wd_gl_render */
+  bool verts_dirty;
 
   struct wl_list heads;
+  /* textures of removed heads, deleted on the next render */
+  struct wl_list released_textures;
 };
 
 struct wd_point {
@@ -177,6 +344,33 @@ struct wd_point {
   double y;
 };
 
+/*
+ * Counters printed on exit if WDISPLAYS_STATS is set in the environment.
+ */
+struct wd_stats {
+  /* tiles of captures without damage, updated by the capture thread */
+  uint64_t tiles_uploaded;
+  uint64_t tiles_skipped;
+  /* output manager done events, and UI updates for head changes from the
+   * compositor, whether batched on done or made right away */
+  uint64_t manager_done;
+  uint64_t head_updates;
+  /* pointer motion events while dragging a head, the layout updates they
+   * were coalesced into and the time spent dragging */
+  uint64_t drag_motions;
+  uint64_t drag_updates;
+  int64_t drag_usecs;
+  /* configurations sent, replaced by newer ones before being sent, and the
+   * time from the edit to the compositor's reply */
+  uint64_t apply_sent;
+  uint64_t apply_collapsed;
+  uint64_t apply_acked;
+  uint64_t apply_latency_usecs;
+  uint64_t apply_latency_max;
+};
+
+struct wd_pending_config;
+
 struct wd_state {
   struct zxdg_output_manager_v1 *xdg_output_manager;
   struct zwlr_output_manager_v1 *output_manager;
@@ -185,7 +379,20 @@ struct wd_state {
   struct wl_shm *shm;
   struct wl_list heads;
   struct wl_list outputs;
+  /* heads and outputs by name, see wd_find_head() */
+  GHashTable *heads_by_name;
+  GHashTable *outputs_by_name;
   uint32_t serial;
+  struct wd_pending_config *apply_sent;
+  struct wd_pending_config *apply_queued;
+  /* configurations being tested and cached results for the current serial */
+  struct wl_list tests;
+  struct wl_array test_verdicts;
+  /* the result of testing the pending edits changed */
+  bool edits_tested;
+  /* fields of the forms are marked because the pending edits failed */
+  bool edits_failed;
+  unsigned modes_generation;
 
   bool apply_pending;
   bool autoapply;
@@ -195,10 +402,17 @@ struct wd_state {
 
   unsigned int apply_idle;
   unsigned int reset_idle;
+  unsigned int test_idle;
+  unsigned int test_edits_timer;
 
   struct wd_render_head_data *clicked;
   struct wd_point drag_start;
   struct wd_point head_drag_start; /* 0-1 range in head rect */
+  /* latest pointer motion of a head drag, applied once per frame */
+  struct wd_point drag_delta;
+  GdkModifierType drag_mods;
+  unsigned int drag_tick;
+  int64_t drag_begin_time;
   bool panning;
   struct wd_point pan_start;
 
@@ -221,6 +435,24 @@ struct wd_state {
   GdkCursor *grabbing_cursor;
   GdkCursor *move_cursor;
 
+  /* screencopy events are dispatched on their own queue by a capture
+   * thread, which shares per-output capture state under capture_lock */
+  struct wl_display *capture_display;
+  struct wl_event_queue *capture_queue;
+  pthread_t capture_thread;
+  pthread_mutex_t capture_lock;
+  int capture_wakeup;
+  atomic_bool capture_quit;
+  /* set by the capture thread when it exits on a connection error */
+  atomic_bool capture_failed;
+  /* signalled when a capture is handed over or fails, so the main loop only
+   * redraws or reschedules when there is something to do */
+  int capture_notify;
+  unsigned int capture_watch;
+  unsigned int capture_timer;
+
+  struct wd_stats stats;
+
   unsigned int canvas_tick;
   struct wd_gl_data *gl_data;
   struct wd_render_data render;
@@ -242,15 +474,28 @@ void wd_state_destroy(struct wd_state *state);
 void wd_fatal_error(int status, const char *message);
 
 /*
- * Add an output to the list of screen captured outputs.
+ * Add an output to the list of screen captured outputs. Its name arrives
+ * with the next roundtrip, which should be shared by all new outputs.
  */
-void wd_add_output(struct wd_state *state, struct wl_output *wl_output, struct wl_display *display);
+void wd_add_output(struct wd_state *state, struct wl_output *wl_output);
+
+/*
+ * Creates the overlays of all outputs that don't have one yet, if overlays
+ * are enabled.
+ */
+void wd_create_overlays(struct wd_state *state);
 
 /*
  * Remove an output from the list of screen captured outputs.
  */
 void wd_remove_output(struct wd_state *state, struct wl_output *wl_output, struct wl_display *display);
 
+/*
+ * Finds a mode of the head by size and refresh rate.
+ */
+struct wd_mode *wd_head_find_mode(const struct wd_head *head,
+    int32_t width, int32_t height, int32_t refresh);
+
 /*
  * Finds the output associated with a given head. Can return NULL if the head's
  * output is disabled.
@@ -258,33 +503,72 @@ void wd_remove_output(struct wd_state *state, struct wl_output *wl_output, struc
 struct wd_output *wd_find_output(struct wd_state *state, struct wd_head *head);
 
 /*
- * Finds the head associated with a given output.
+ * Finds the head associated with a given output. Heads and outputs are
+ * linked when their names match, so neither lookup searches.
  */
 struct wd_head *wd_find_head(struct wd_state *state, struct wd_output *output);
 /*
- * Starts listening for output management events from the compositor.
+ * Binds the globals and starts listening for output management events from
+ * the compositor. The heads are enumerated with the next roundtrip.
  */
 void wd_add_output_management_listener(struct wd_state *state, struct wl_display *display);
 
 /*
- * Sends updated display configuration back to the compositor.
+ * Sends updated display configuration back to the compositor without
+ * waiting for the reply. If one is still being processed, the new one is
+ * sent after it and replaces any other configuration waiting to be sent.
  */
 void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs, struct wl_display *display);
 
 /*
- * Queues capture of the next frame of all screens.
+ * Tests a display configuration in the background and takes ownership of
+ * the list. Returns the cached result, or WD_TEST_PENDING if a test was
+ * sent, in which case wd_ui_test_done() is called when it completes.
+ */
+enum wd_test_result wd_test_state(struct wd_state *state, struct wl_list *outputs);
+
+/*
+ * Returns whether switching the head to this mode passed its test. Modes are
+ * tested whenever the server state changes.
+ */
+enum wd_test_result wd_test_mode_result(const struct wd_mode *mode);
+
+/*
+ * Starts the thread that services screencopy events. Captures are dispatched
+ * on the main loop if the thread can't be started.
+ */
+void wd_capture_start(struct wd_state *state, struct wl_display *display);
+
+/*
+ * Queues capture of the next frame of all screens. Returns the microseconds
+ * until a capture times out or is retried after failures, when this has to be
+ * called again, or -1 if there is no such deadline.
+ */
+int64_t wd_capture_frame(struct wd_state *state);
+
+/*
+ * Clears the capture notification. Returns true if a new capture is waiting
+ * to be picked up with wd_capture_current().
  */
-void wd_capture_frame(struct wd_state *state);
+bool wd_capture_poll(struct wd_state *state);
 
 /*
- * Blocks until all captures are finished.
+ * Returns the capture of an output to show, picking up the latest one that
+ * completed on the capture thread. Main thread only.
  */
-void wd_capture_wait(struct wd_state *state, struct wl_display *display);
+struct wd_frame *wd_capture_current(struct wd_output *output);
 
 /*
- * Updates the UI stack of all heads. Does not update individual head forms.
- * Useful for when a display is plugged/unplugged and we want to add/remove
- * a page, but we don't want to wipe out user's changes on the other pages.
+ * Cancels all captures that have not completed yet. Captures waiting for
+ * damage may otherwise never finish on a static screen.
+ */
+void wd_capture_cancel(struct wd_state *state, struct wl_display *display);
+
+/*
+ * Updates the UI stack of all heads, and the fields of each head form that
+ * the compositor changed since the last call. Useful for when a display is
+ * plugged/unplugged and we want to add/remove a page, but we don't want to
+ * wipe out user's changes on the other pages.
  */
 void wd_ui_reset_heads(struct wd_state *state);
 
@@ -304,6 +588,11 @@ void wd_ui_reset_all(struct wd_state *state);
  */
 void wd_ui_apply_done(struct wd_state *state, struct wl_list *outputs);
 
+/*
+ * Updates the marks of invalid choices after a configuration test completed.
+ */
+void wd_ui_test_done(struct wd_state *state);
+
 /*
  * Reactivates the GUI after the display configuration updates.
  */
@@ -320,9 +609,48 @@ struct wd_gl_data *wd_gl_setup(void);
 void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info, uint64_t tick);
 
 /*
- * Destroys the GL shaders.
+ * Hands the texture of a head that is going away to the renderer, which
+ * deletes it once the GL context is current. Safe to call without a context.
+ */
+void wd_gl_release_head(struct wd_render_data *info,
+    struct wd_render_head_data *head);
+
+/*
+ * Destroys the GL shaders and the textures of all heads.
+ */
+void wd_gl_cleanup(struct wd_gl_data *res, struct wd_render_data *info);
+
+/*
+ * Picks the largest power of two that a captured frame can be shrunk by while
+ * still covering the given on-canvas size in each dimension.
  */
-void wd_gl_cleanup(struct wd_gl_data *res);
+unsigned wd_preview_scale_shift(unsigned src_width, unsigned src_height,
+    unsigned dst_width, unsigned dst_height);
+
+/*
+ * Shrinks a 32-bit image by 2^shift (shift >= 1), swapping the red and blue
+ * channels if swap_rb is set. Each destination pixel is the rounded average
+ * of its whole 2^shift by 2^shift source block. Only the destination region
+ * given by rect is written.
+ */
+void wd_downscale(const uint8_t *src, unsigned src_stride,
+    uint8_t *dst, unsigned dst_stride,
+    const struct wd_rect *rect, unsigned shift, bool swap_rb);
+
+/*
+ * Hashes a block of 32-bit pixels, for telling whether it changed.
+ */
+uint64_t wd_hash_tile(const uint8_t *src, unsigned stride,
+    unsigned width, unsigned height);
+
+/*
+ * Points the head's texture data at a newly captured frame, downscaling it
+ * to about target_width x target_height. The damage list is translated to
+ * the scaled image; full forces the whole texture to be uploaded.
+ */
+void wd_preview_update(struct wd_render_head_data *render,
+    struct wd_frame *frame, unsigned target_width, unsigned target_height,
+    bool full);
 
 /*
  * Create an overlay on the screen that contains a textual description of the
@@ -348,11 +676,6 @@ void wd_destroy_overlay(struct wd_output *output);
  */
 char *wd_get_config_file_path();
 
-/*
- * Returns kanshi config path
- */
-char *wd_get_kanshi_config();
-
 /*
  * Updates kanshi config
  */
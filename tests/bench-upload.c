@@ -0,0 +1,116 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Measures the cost of replacing the contents of a preview texture every
+ * frame, the way wd_gl_render did before texture storage was kept across
+ * uploads and the ways alloc_storage and update_texture do now: a single
+ * level, with no mipmaps since previews are scaled down by the FBO pass.
+ * Run with `meson test --benchmark`.
+ */
+
+#include "egl-context.h"
+
+#include <epoxy/gl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* each case runs for this many frames or this long, whichever ends first */
+#define BENCH_FRAMES 500
+#define BENCH_USECS 1000000
+
+enum upload_path {
+  /* glTexImage2D with the pixels and glGenerateMipmap every frame, as before */
+  UPLOAD_REALLOC,
+  /* one level of glTexStorage2D once, then glTexSubImage2D, on GLES 3 */
+  UPLOAD_STORAGE,
+  /* glTexImage2D without pixels once, then glTexSubImage2D, on GLES 2 */
+  UPLOAD_GLES2,
+};
+
+static const char *path_names[] = {
+  [UPLOAD_REALLOC] = "teximage + mipmap",
+  [UPLOAD_STORAGE] = "texstorage + subimage",
+  [UPLOAD_GLES2] = "teximage once + subimage",
+};
+
+static const struct {
+  int width;
+  int height;
+} sizes[] = {
+  { 480, 270 },
+  { 960, 540 },
+  { 1920, 1080 },
+};
+
+static uint64_t get_time_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double bench(enum upload_path path, uint8_t *pixels,
+    int width, int height) {
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  if (path == UPLOAD_STORAGE) {
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+  } else if (path == UPLOAD_GLES2) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+        GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  }
+  glFinish();
+
+  uint64_t begin = get_time_usecs();
+  uint64_t elapsed = 0;
+  int frames = 0;
+  while (frames < BENCH_FRAMES && elapsed < BENCH_USECS) {
+    /* a new frame, so nothing can be skipped as unchanged */
+    pixels[(size_t) frames * 4 % ((size_t) width * height * 4)]++;
+    if (path == UPLOAD_REALLOC) {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+          GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+      glGenerateMipmap(GL_TEXTURE_2D);
+    } else {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+          GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    }
+    glFinish();
+    frames++;
+    elapsed = get_time_usecs() - begin;
+  }
+  glDeleteTextures(1, &texture);
+  return (double) elapsed / frames;
+}
+
+int main(void) {
+  if (!make_egl_context()) {
+    printf("skipped, no surfaceless EGL context\n");
+    return EXIT_SKIP;
+  }
+  printf("%s\n", (const char *) glGetString(GL_RENDERER));
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    int width = sizes[s].width;
+    int height = sizes[s].height;
+    uint8_t *pixels = calloc((size_t) width * height, 4);
+    if (pixels == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    for (enum upload_path path = 0; path <= UPLOAD_GLES2; path++) {
+      double usecs = bench(path, pixels, width, height);
+      printf("%4dx%-4d %-26s %8.1f us/frame\n", width, height,
+          path_names[path], usecs);
+    }
+    free(pixels);
+  }
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    fprintf(stderr, "GL error 0x%x\n", error);
+    return 1;
+  }
+  return 0;
+}
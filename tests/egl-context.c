@@ -0,0 +1,28 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "egl-context.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stddef.h>
+
+bool make_egl_context(void) {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+    eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display == NULL) {
+    return false;
+  }
+  EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+      EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)
+      || !eglBindAPI(EGL_OPENGL_ES_API)) {
+    return false;
+  }
+  static const EGLint attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_NONE };
+  EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+      EGL_NO_CONTEXT, attribs);
+  return context != EGL_NO_CONTEXT
+    && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
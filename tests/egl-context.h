@@ -0,0 +1,18 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#ifndef WDISPLAY_TESTS_EGL_CONTEXT_H
+#define WDISPLAY_TESTS_EGL_CONTEXT_H
+
+#include <stdbool.h>
+
+/* exit status meson reports as a skipped test */
+#define EXIT_SKIP 77
+
+/*
+ * Makes a GLES 3 context current without any window system, so tests can
+ * draw into framebuffer objects. Returns false if the driver can't do that.
+ */
+bool make_egl_context(void);
+
+#endif
@@ -0,0 +1,92 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Checks every downscale kernel this CPU can run against a plain box filter,
+ * for each shift and with and without swapping red and blue.
+ */
+
+#include "downscale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* odd and wider than one chunk, so the vector loops leave a tail */
+#define DST_WIDTH 67
+#define DST_HEIGHT 5
+/* unused bytes at the end of each source row */
+#define SRC_PADDING 12
+
+static void box_filter(const uint8_t *src, unsigned src_stride,
+    uint8_t *dst, unsigned dst_stride, unsigned shift, bool swap_rb) {
+  unsigned block = 1u << shift;
+  for (unsigned y = 0; y < DST_HEIGHT; y++) {
+    for (unsigned x = 0; x < DST_WIDTH; x++) {
+      for (unsigned c = 0; c < 4; c++) {
+        unsigned sc = swap_rb && c != 3 ? 2 - c : c;
+        unsigned total = 0;
+        for (unsigned by = 0; by < block; by++) {
+          const uint8_t *row = src + (y * block + by) * src_stride;
+          for (unsigned bx = 0; bx < block; bx++) {
+            total += row[(x * block + bx) * 4 + sc];
+          }
+        }
+        dst[y * dst_stride + x * 4 + c] =
+          (total + block * block / 2) / (block * block);
+      }
+    }
+  }
+}
+
+int main(void) {
+  size_t count;
+  const struct wd_downscale_kernel *const *kernels =
+    wd_downscale_kernels(&count);
+  unsigned dst_stride = DST_WIDTH * 4;
+  size_t dst_size = (size_t) dst_stride * DST_HEIGHT;
+  uint8_t *expected = malloc(dst_size);
+  uint8_t *actual = malloc(dst_size);
+  unsigned src_stride = (DST_WIDTH << WD_DOWNSCALE_MAX_SHIFT) * 4
+    + SRC_PADDING;
+  size_t src_size = (size_t) src_stride
+    * (DST_HEIGHT << WD_DOWNSCALE_MAX_SHIFT);
+  uint8_t *src = malloc(src_size);
+  if (expected == NULL || actual == NULL || src == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  srand(1);
+  int failures[4] = { 0 };
+  for (int round = 0; round < 4; round++) {
+    for (size_t i = 0; i < src_size; i++) {
+      /* the first round stresses the sums with saturated pixels */
+      src[i] = round == 0 ? 255 : rand();
+    }
+    for (unsigned shift = 1; shift <= WD_DOWNSCALE_MAX_SHIFT; shift++) {
+      unsigned stride = ((DST_WIDTH << shift) * 4) + SRC_PADDING;
+      for (int swap_rb = 0; swap_rb <= 1; swap_rb++) {
+        box_filter(src, stride, expected, dst_stride, shift, swap_rb);
+        for (size_t k = 0; k < count; k++) {
+          memset(actual, 0, dst_size);
+          wd_downscale_region(kernels[k], src, stride, actual, dst_stride,
+              0, 0, DST_WIDTH, DST_HEIGHT, shift, swap_rb);
+          if (memcmp(actual, expected, dst_size) != 0) {
+            fprintf(stderr, "%s: mismatch at shift %u, swap_rb %d\n",
+                kernels[k]->name, shift, swap_rb);
+            failures[k]++;
+          }
+        }
+      }
+    }
+  }
+  int failed = 0;
+  for (size_t k = 0; k < count; k++) {
+    printf("%s: %s\n", kernels[k]->name, failures[k] ? "FAIL" : "ok");
+    failed |= failures[k];
+  }
+  free(src);
+  free(actual);
+  free(expected);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Draws 256 synthetic heads in a surfaceless EGL context, without a
+ * compositor, and checks that each one shows up where it was placed. Skipped
+ * if no such context can be made.
+ */
+
+#include "egl-context.h"
+#include "wdisplays.h"
+
+#include <epoxy/gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HEAD_COUNT 256
+/* heads are laid out on a 16 by 16 grid of cells */
+#define GRID 16
+#define CELL_WIDTH 40
+#define CELL_HEIGHT 30
+#define TEX_WIDTH 32
+#define TEX_HEIGHT 24
+
+static void place_head(struct wd_render_head_data *render, int cell) {
+  render->x1 = (cell % GRID) * CELL_WIDTH;
+  render->y1 = (cell / GRID) * CELL_HEIGHT;
+  render->x2 = render->x1 + CELL_WIDTH - 4;
+  render->y2 = render->y1 + CELL_HEIGHT - 4;
+}
+
+/* checks that the middle of each cell shows the head placed there */
+static int check_heads(const struct wd_render_head_data *renders,
+    const int *cells, const char *step) {
+  int width = GRID * CELL_WIDTH;
+  int height = GRID * CELL_HEIGHT;
+  uint8_t *pixels = malloc((size_t) width * height * 4);
+  if (pixels == NULL) {
+    return 1;
+  }
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+  int failures = 0;
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    const struct wd_render_head_data *render = &renders[i];
+    if (render->pixels == NULL) {
+      continue;
+    }
+    int x = (render->x1 + render->x2) / 2;
+    int y = height - 1 - (int) (render->y1 + render->y2) / 2;
+    const uint8_t *pixel = pixels + ((size_t) y * width + x) * 4;
+    if (pixel[0] != render->pixels[0] || pixel[1] != render->pixels[1]) {
+      if (failures++ < 4) {
+        fprintf(stderr, "%s: head %d in cell %d shows %d,%d not %d,%d\n",
+            step, i, cells[i], pixel[0], pixel[1],
+            render->pixels[0], render->pixels[1]);
+      }
+    }
+  }
+  free(pixels);
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    fprintf(stderr, "%s: GL error 0x%x\n", step, error);
+    failures++;
+  }
+  return failures;
+}
+
+int main(void) {
+  if (!make_egl_context()) {
+    printf("render: skipped, no surfaceless EGL context\n");
+    return EXIT_SKIP;
+  }
+  int width = GRID * CELL_WIDTH;
+  int height = GRID * CELL_HEIGHT;
+  GLuint framebuffer, renderbuffer;
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glGenRenderbuffers(1, &renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+      GL_RENDERBUFFER, renderbuffer);
+  glViewport(0, 0, width, height);
+
+  struct wd_gl_data *res = wd_gl_setup();
+  struct wd_render_data info = {
+    .viewport_width = width,
+    .viewport_height = height,
+    .preview_filter = WD_PREVIEW_FILTER_BILINEAR,
+    .fg_color = { 1.f, 1.f, 1.f, 0.f },
+  };
+  wl_list_init(&info.heads);
+  wl_list_init(&info.released_textures);
+
+  struct wd_render_head_data *renders = calloc(HEAD_COUNT, sizeof(*renders));
+  uint8_t *pixels = malloc((size_t) HEAD_COUNT * TEX_WIDTH * TEX_HEIGHT * 4);
+  int cells[HEAD_COUNT];
+  if (renders == NULL || pixels == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    struct wd_render_head_data *render = &renders[i];
+    uint8_t *head_pixels = pixels + (size_t) i * TEX_WIDTH * TEX_HEIGHT * 4;
+    for (int p = 0; p < TEX_WIDTH * TEX_HEIGHT; p++) {
+      head_pixels[p * 4] = i;
+      head_pixels[p * 4 + 1] = 255 - i;
+      head_pixels[p * 4 + 2] = 128;
+      head_pixels[p * 4 + 3] = 255;
+    }
+    render->pixels = head_pixels;
+    render->generation = 1;
+    render->full_damage = true;
+    render->tex_stride = TEX_WIDTH * 4;
+    render->tex_width = TEX_WIDTH;
+    render->tex_height = TEX_HEIGHT;
+    render->tex_region = (struct wd_fbox) { 0.f, 0.f, 1.f, 1.f };
+    render->target_width = TEX_WIDTH;
+    render->target_height = TEX_HEIGHT;
+    render->preview = true;
+    render->swap_rgb = true;
+    cells[i] = i;
+    place_head(render, i);
+    wl_list_insert(info.heads.prev, &render->link);
+  }
+  info.verts_dirty = true;
+
+  int failures = 0;
+  uint64_t tick = 1000000000;
+  wd_gl_render(res, &info, tick);
+  failures += check_heads(renders, cells, "first frame");
+
+  /* reversing the layout changes every quad but no texture */
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    cells[i] = HEAD_COUNT - 1 - i;
+    place_head(&renders[i], cells[i]);
+  }
+  info.verts_dirty = true;
+  wd_gl_render(res, &info, tick += 16667);
+  failures += check_heads(renders, cells, "reversed");
+
+  /* dropping every other head frees their layers, bringing them back has
+   * them allocate new ones */
+  for (int i = 0; i < HEAD_COUNT; i += 2) {
+    wl_list_remove(&renders[i].link);
+    wd_gl_release_head(&info, &renders[i]);
+  }
+  wd_gl_render(res, &info, tick += 16667);
+  for (int i = 0; i < HEAD_COUNT; i += 2) {
+    renders[i].generation++;
+    renders[i].full_damage = true;
+    wl_list_insert(info.heads.prev, &renders[i].link);
+  }
+  info.verts_dirty = true;
+  wd_gl_render(res, &info, tick += 16667);
+  failures += check_heads(renders, cells, "readded");
+
+  /* a frame where nothing changed draws the same thing */
+  wd_gl_render(res, &info, tick += 16667);
+  failures += check_heads(renders, cells, "unchanged");
+
+  wd_gl_cleanup(res, &info);
+  free(pixels);
+  free(renders);
+  printf("render: %s\n", failures ? "FAIL" : "ok");
+  return failures ? 1 : 0;
+}
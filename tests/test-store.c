@@ -0,0 +1,107 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Stores a kanshi profile for 256 synthetic heads and then rewrites it with
+ * the heads moved, without a compositor.
+ */
+
+#include "wdisplays.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEAD_COUNT 256
+/* heads are placed on a 16 by 16 grid */
+#define GRID 16
+
+static int count_lines(const char *file_name, const char *prefix) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  char line[LINE_MAX];
+  int count = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, prefix, strlen(prefix)) == 0) {
+      count++;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+int main(void) {
+  char dir[] = "/tmp/wdisplays-test-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  char file_name[PATH_MAX];
+  snprintf(file_name, sizeof(file_name), "%s/config", dir);
+  setenv("XDG_CONFIG_HOME", dir, 1);
+  setenv("WDISPLAYS_KANSHI_CONFIG", file_name, 1);
+
+  struct wd_head *heads = calloc(HEAD_COUNT, sizeof(*heads));
+  struct wd_head_config *configs = calloc(HEAD_COUNT, sizeof(*configs));
+  if (heads == NULL || configs == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  struct wl_list outputs;
+  wl_list_init(&outputs);
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    char description[64];
+    snprintf(description, sizeof(description), "Test Monitor %d", i);
+    heads[i].description = strdup(description);
+    configs[i].head = &heads[i];
+    configs[i].enabled = true;
+    configs[i].width = 1920;
+    configs[i].height = 1080;
+    configs[i].refresh = 60000;
+    configs[i].x = (i % GRID) * 1920;
+    configs[i].y = (i / GRID) * 1080;
+    configs[i].scale = 1.;
+    wl_list_insert(outputs.prev, &configs[i].link);
+  }
+
+  int failures = 0;
+  /* the first store appends a profile, the second rewrites it in place */
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < HEAD_COUNT; i++) {
+      configs[i].x += pass * 100;
+    }
+    if (wd_store_config(&outputs) != 0) {
+      fprintf(stderr, "store pass %d failed\n", pass);
+      failures++;
+    }
+    int profiles = count_lines(file_name, "profile");
+    int lines = count_lines(file_name, "    output ");
+    if (profiles != 1 || lines != HEAD_COUNT) {
+      fprintf(stderr, "store pass %d: %d profiles, %d outputs\n",
+          pass, profiles, lines);
+      failures++;
+    }
+  }
+  char expected[128];
+  snprintf(expected, sizeof(expected),
+      "    output \"Test Monitor %d\" position %d,", HEAD_COUNT - 1,
+      configs[HEAD_COUNT - 1].x);
+  if (count_lines(file_name, expected) != 1) {
+    fprintf(stderr, "rewritten profile lacks: %s\n", expected);
+    failures++;
+  }
+
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    free(heads[i].description);
+  }
+  free(configs);
+  free(heads);
+  unlink(file_name);
+  rmdir(dir);
+  printf("store: %s\n", failures ? "FAIL" : "ok");
+  return failures ? 1 : 0;
+}
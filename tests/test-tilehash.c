@@ -0,0 +1,71 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Checks that every tile hash kernel this CPU can run gives the same hash as
+ * the portable one, for widths that leave a tail and unaligned, padded rows.
+ */
+
+#include "tilehash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_WIDTH 67
+#define MAX_HEIGHT 5
+/* unused bytes at the end of each row, not a multiple of the pixel size */
+#define ROW_PADDING 13
+
+int main(void) {
+  size_t count;
+  const struct wd_hash_kernel *const *kernels = wd_hash_kernels(&count);
+  unsigned stride = MAX_WIDTH * 4 + ROW_PADDING;
+  /* one spare byte so rows can start off alignment */
+  size_t size = (size_t) stride * MAX_HEIGHT + 1;
+  uint8_t *pixels = malloc(size);
+  if (pixels == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < size; i++) {
+    pixels[i] = rand();
+  }
+  int failures[3] = { 0 };
+  int collisions = 0;
+  for (unsigned offset = 0; offset <= 1; offset++) {
+    const uint8_t *src = pixels + offset;
+    for (unsigned height = 1; height <= MAX_HEIGHT; height++) {
+      for (unsigned width = 1; width <= MAX_WIDTH; width++) {
+        uint64_t expected = wd_hash_region(kernels[0], src, stride,
+            width, height);
+        for (size_t k = 1; k < count; k++) {
+          uint64_t actual = wd_hash_region(kernels[k], src, stride,
+              width, height);
+          if (actual != expected) {
+            fprintf(stderr, "%s: mismatch at %ux%u, offset %u\n",
+                kernels[k]->name, width, height, offset);
+            failures[k]++;
+          }
+        }
+        /* the last pixel changing must change the hash */
+        uint8_t *last = pixels + offset + (size_t) (height - 1) * stride
+          + (width - 1) * 4;
+        (*last)++;
+        if (wd_hash_region(kernels[0], src, stride, width, height)
+            == expected) {
+          fprintf(stderr, "scalar: unchanged hash at %ux%u\n", width, height);
+          collisions++;
+        }
+        (*last)--;
+      }
+    }
+  }
+  int failed = collisions;
+  for (size_t k = 0; k < count; k++) {
+    printf("%s: %s\n", kernels[k]->name, failures[k] ? "FAIL" : "ok");
+    failed |= failures[k];
+  }
+  free(pixels);
+  return failed ? 1 : 0;
+}